@@ -1404,7 +1404,8 @@ class DTParser {
                 DomTerm.setInputMode(this.getParameter(1, 112), term);
                 break;
             case 81: // get-window-contents
-                term.saveWindowContents();
+                // 81;1: send full contents, not WINDOW-CONTENTS-DELTA
+                term.saveWindowContents(this.getParameter(1, 0) == 1);
                 term._removeInputLine();
                 break;
             case 82:
@@ -1484,6 +1485,7 @@ class DTParser {
                     break;
                 case 96: //re-connected
                     term.popRestoreScreenBuffer();
+                    term._remoteReconnectCount = 0;
                     break;
                 case 97:
                 case 98:
@@ -1491,6 +1493,9 @@ class DTParser {
                         term.log("DISCONNECTED! (pty close)");
                     if (term.initial.classList.contains("reconnecting"))
                         term.popRestoreScreenBuffer();
+                    if (! term._showConnectFailElement
+                        && term._autoReconnectRemote())
+                        break;
                     term.showConnectFailure(-1);
                     break;
                 case 99:
@@ -2283,57 +2288,12 @@ class DTParser {
         case 103: // restore saved snapshot
             var comma = text.indexOf(",");
             var rcount = Number(text.substring(0,comma));
-            var data = DtUtil.fromJson(text.substring(comma+1));
-            let main = term.initial;
-            if (main instanceof Element &&
-                main.getAttribute('class') == 'dt-buffer') {
-                term._vspacer.insertAdjacentHTML('beforebegin', data.html);
-                var parent = main.parentNode;
-                parent.removeChild(main);
-                term.sstate = data.sstate;
-                term.topNode.setAttribute("session-number",
-                                          term.sstate.sessionNumber);
-                var dt = term;
-                term._inputLine = null;
-                function findInputLine(node) {
-                    if (node.getAttribute('std') == 'caret')
-                        dt._caretNode = node;
-                    if (node.classList.contains('editing'))
-                        dt._inputLine = node;
-                    return true;
-                };
-                term._replayMode = true;
-                term.initial = DomTerm._currentBufferNode(term, -1);
-                let bufAttr = term.initial.getAttribute("buffer");
-                term.usingAlternateScreenBuffer =
-                    bufAttr && bufAttr.indexOf("alternate") >= 0;
-                DtUtil.forEachElementIn(parent, findInputLine);
-                term.outputBefore =
-                    term._inputLine != null ? term._inputLine : term._caretNode;
-                term.outputContainer = term.outputBefore.parentNode;
-                term.resetCursorCache();
-                term._restoreLineTables(term.topNode, 0);
-                DomTerm._addMouseEnterHandlers(term);
-                if (data.rows && data.columns)
-                    dt.forceWidthInColumns(data.columns, data.rows, 8);
-                dt._breakAllLines();
-                const home_node = main.querySelector("*[home-line]");
-                if (home_node) {
-                    const home_line = home_node.getAttribute("home-line");
-                    const home_offset = parseInt(home_line) || 0;
-                    dt.homeLine = dt._computeHomeLine(home_node, home_offset,
-                                                      dt.usingAlternateScreenBuffer);
-                    home_node.removeAttribute("home-line");
-                }
-                term.updateWindowTitle();
-                let saved = term._savedControlState;
-                if (saved && ! saved.counted)
-                    saved.receivedCount = rcount;
-                else
-                    term._receivedCount = rcount;
-                term._confirmedCount = rcount;
-                term._replayMode = false;
-            }
+            if (text.charAt(comma+1) == 'z')
+                DTParser.restoreCompressedSnapshot(term, rcount,
+                                                   text.substring(comma+2));
+            else
+                DTParser.restoreSnapshot(term, rcount,
+                                         DtUtil.fromJson(text.substring(comma+1)));
             break;
         case 104: {
             // Reset color number
@@ -2654,4 +2614,81 @@ DTParser.PAUSE_REQUESTED = 24;
 
 DTParser.REPLACEMENT_CHARACTER = 0xFFFD;
 
+DTParser.restoreSnapshot = function(term, rcount, data) {
+    let main = term.initial;
+    if (main instanceof Element &&
+        main.getAttribute('class') == 'dt-buffer') {
+        term._vspacer.insertAdjacentHTML('beforebegin', data.html);
+        var parent = main.parentNode;
+        parent.removeChild(main);
+        term.sstate = data.sstate;
+        term.topNode.setAttribute("session-number",
+                                  term.sstate.sessionNumber);
+        var dt = term;
+        term._inputLine = null;
+        function findInputLine(node) {
+            if (node.getAttribute('std') == 'caret')
+                dt._caretNode = node;
+            if (node.classList.contains('editing'))
+                dt._inputLine = node;
+            return true;
+        };
+        term._replayMode = true;
+        term.initial = DomTerm._currentBufferNode(term, -1);
+        let bufAttr = term.initial.getAttribute("buffer");
+        term.usingAlternateScreenBuffer =
+            bufAttr && bufAttr.indexOf("alternate") >= 0;
+        DtUtil.forEachElementIn(parent, findInputLine);
+        term.outputBefore =
+            term._inputLine != null ? term._inputLine : term._caretNode;
+        term.outputContainer = term.outputBefore.parentNode;
+        term.resetCursorCache();
+        term._restoreLineTables(term.topNode, 0);
+        DomTerm._addMouseEnterHandlers(term);
+        if (data.rows && data.columns)
+            dt.forceWidthInColumns(data.columns, data.rows, 8);
+        dt._breakAllLines();
+        const home_node = main.querySelector("*[home-line]");
+        if (home_node) {
+            const home_line = home_node.getAttribute("home-line");
+            const home_offset = parseInt(home_line) || 0;
+            dt.homeLine = dt._computeHomeLine(home_node, home_offset,
+                                              dt.usingAlternateScreenBuffer);
+            home_node.removeAttribute("home-line");
+        }
+        term.updateWindowTitle();
+        let saved = term._savedControlState;
+        if (saved && ! saved.counted)
+            saved.receivedCount = rcount;
+        else
+            term._receivedCount = rcount;
+        term._confirmedCount = rcount;
+        term._replayMode = false;
+    }
+};
+
+// Restore a snapshot sent (by handle_output in protocol.cc) as 'z'
+// followed by base64-encoded zlib data.  Uncompressing is asynchronous,
+// so later output is held back (by insertBytes) until it is done.
+DTParser.restoreCompressedSnapshot = function(term, rcount, b64) {
+    const pending = { bytes: [] };
+    term._pendingSnapshot = pending;
+    const zdata = Uint8Array.from(atob(b64), (c) => c.charCodeAt(0));
+    const stream = new Blob([zdata]).stream()
+          .pipeThrough(new DecompressionStream("deflate"));
+    new Response(stream).arrayBuffer().then((buffer) => {
+        const raw = new Uint8Array(buffer);
+        DTParser.restoreSnapshot(term, rcount,
+                                 DtUtil.fromJson(new TextDecoder().decode(raw)));
+        // The server keeps this, as the base for WINDOW-CONTENTS-DELTA.
+        term._snapshotBase = { rcount: rcount, bytes: raw };
+    }).catch((e) => {
+        term.log("failed to uncompress saved snapshot - "+e);
+    }).finally(() => {
+        term._pendingSnapshot = undefined;
+        for (const bytes of pending.bytes)
+            term.insertBytes(bytes);
+    });
+};
+
 window.DTParser = DTParser;
@@ -1093,18 +1093,49 @@ DomTerm.isFrameParent = function() {
         && DomTerm._oldFocusedContent;
 }
 
-Terminal.prototype.saveWindowContents = function() {
+// If full is true, don't send WINDOW-CONTENTS-DELTA.
+Terminal.prototype.saveWindowContents = function(full = false) {
     this._restoreInputLine();
     var rcount = this.parser._savedControlState ? this.parser._savedControlState.receivedCount
         : this._receivedCount;
-    var data =
-        rcount
-        + ',{"sstate":'+DtUtil.toJson(this.sstate);
+    var data = '{"sstate":'+DtUtil.toJson(this.sstate);
     data += ',"rows":'+this.numRows+',"columns":'+this.numColumns;
     data += ', "html":'
         + JSON.stringify(this.getAsHTML(false))
         +'}';
-    this.reportEvent("WINDOW-CONTENTS", data);
+    const base = this._snapshotBase;
+    if (! base) {
+        this.reportEvent("WINDOW-CONTENTS", rcount + ',' + data);
+        return;
+    }
+    // The server has base (see DTParser.restoreCompressedSnapshot),
+    // so only send the part that is different, as byte offsets.
+    const encoder = this._encoder || (this._encoder = new TextEncoder());
+    const bytes = encoder.encode(data);
+    const old = base.bytes;
+    const nlen = bytes.length, olen = old.length;
+    const max = Math.min(nlen, olen);
+    let prefix = 0;
+    while (prefix < max && bytes[prefix] === old[prefix])
+        prefix++;
+    let suffix = 0;
+    while (suffix < max - prefix
+           && bytes[nlen - 1 - suffix] === old[olen - 1 - suffix])
+        suffix++;
+    // Don't split a UTF-8 sequence.
+    while (prefix > 0 && (bytes[prefix] & 0xC0) === 0x80)
+        prefix--;
+    while (suffix > 0 && (bytes[nlen - suffix] & 0xC0) === 0x80)
+        suffix--;
+    this._snapshotBase = { rcount: rcount, bytes: bytes };
+    if (full || 2 * (prefix + suffix) < nlen) {
+        this.reportEvent("WINDOW-CONTENTS", rcount + ',' + data);
+        return;
+    }
+    const middle = new TextDecoder().decode(bytes.subarray(prefix, nlen - suffix));
+    this.reportEvent("WINDOW-CONTENTS-DELTA",
+                     rcount + ',' + base.rcount + ',' + olen
+                     + ',' + prefix + ',' + suffix + ',' + middle);
 }
 
 DomTerm.closeFromEof = function(dt) {
@@ -5894,6 +5925,25 @@ Terminal.prototype.setSettings = function(obj) {
     let settingsCounter = obj["##"];
     if (DomTerm._settingsCounter == settingsCounter)
         return;
+    const base = obj["#delta"];
+    if (base !== undefined) {
+        // Only the changed settings (relative to base); null if removed.
+        if (base != DomTerm._settingsCounter) {
+            // We don't have the base settings - get all of them.
+            this.reportEvent("REQUEST-SETTINGS", "");
+            return;
+        }
+        const merged = Object.assign({}, DomTerm.globalSettings);
+        for (const key in obj) {
+            if (key === "#delta")
+                continue;
+            if (obj[key] === null)
+                delete merged[key];
+            else
+                merged[key] = obj[key];
+        }
+        obj = merged;
+    }
     DomTerm.globalSettings = obj;
     DomTerm._settingsCounter = settingsCounter;
     this.updateSettings();
@@ -6720,6 +6770,11 @@ Terminal.prototype.insertBytes = function(bytes, startIndex = 0, endIndex = byte
     if (DomTerm.verbosity >= 2)
         this.log("insertBytes "+this.name+" "+typeof bytes+" count:"+(endIndex-startIndex)+" received:"+this._receivedCount);
     while (startIndex < endIndex) {
+        if (this._pendingSnapshot) {
+            // See DTParser.restoreCompressedSnapshot
+            this._pendingSnapshot.bytes.push(bytes.slice(startIndex, endIndex));
+            return;
+        }
         let urgent_begin = -1;
         let urgent_end = -1;
         for (let  i = startIndex; i < endIndex; i++) {
@@ -9954,6 +10009,32 @@ DomTerm.initXtermJs = function(dt, topNode) { // OBSOLETE
     xterm.addOscHandler(30, function(data) { dt.setWindowTitle(data, 30); return false; });
 }
 
+/** The ssh connection to a remote session was lost (timed out,
+ * or ssh failed).  Try to re-attach, a remote-reconnect number of times,
+ * waiting longer each time, before asking the user.
+ * The remote only replays output after _receivedCount.
+ * Returns false if there are no attempts left. */
+Terminal.prototype._autoReconnectRemote = function() {
+    const attempts = this.getOption("remote-reconnect", 5);
+    const count = this._remoteReconnectCount || 0;
+    if (count >= attempts) {
+        this._remoteReconnectCount = 0;
+        return false;
+    }
+    this._remoteReconnectCount = count + 1;
+    const delay = Math.min(500 * (1 << count), 16000);
+    if (DomTerm.verbosity >= 1)
+        this.log("re-connecting to remote in "+delay+"ms - attempt "+this._remoteReconnectCount);
+    this.sstate.disconnected = true;
+    setTimeout(() => {
+        if (! this.sstate.disconnected || this._showConnectFailElement)
+            return;
+        this.sstate.disconnected = false;
+        this.reportEvent("RECONNECT", this.sstate.sessionNumber+","+this._receivedCount);
+    }, delay);
+    return true;
+};
+
 Terminal.prototype.showConnectFailure = function(ecode, reconnect=null, toRemote=true)  {
     if (this._showConnectFailElement)
         return;
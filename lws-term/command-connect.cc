@@ -155,7 +155,12 @@ callback_cmd_socket(struct lws *wsi, enum lws_callback_reasons reason,
         client->exit_code = rbuf[nr-1];
 #else
         int start = 0;
-        for (int i = 0; ; i++) {
+        if (client->quote_pending) {
+            client->quote_pending = false;
+            write(cur_out, rbuf, 1);
+            start = 1;
+        }
+        for (int i = start; ; i++) {
 	    int ch = i >= nr ? -1 : rbuf[i];
             if (ch <= '\003' && (cur_out >= 0 || ch < 0)) {
                 if (i > start) {
@@ -167,7 +172,13 @@ callback_cmd_socket(struct lws *wsi, enum lws_callback_reasons reason,
                 if (ch < 0)
                     break;
                 start = i+1;
-                if (ch == PASS_STDFILES_SWITCH_TO_STDERR)
+                if (ch == PASS_STDFILES_QUOTE) {
+                    if (i + 1 == nr) {
+                        client->quote_pending = true;
+                        break;
+                    }
+                    start = ++i; // literal byte starts next segment
+                } else if (ch == PASS_STDFILES_SWITCH_TO_STDERR)
                     cur_out = STDERR_FILENO;
                 else if (ch == PASS_STDFILES_SWITCH_TO_STDOUT)
                     cur_out = STDOUT_FILENO;
@@ -255,6 +266,7 @@ client_send_command(int socket, int argc, char *const*argv, char *const *env)
     struct cmd_socket_client *cclient = (struct cmd_socket_client *) lws_wsi_user(cmdwsi);
     cclient->socket = socket;
     cclient->exit_code = EXIT_UNSPECIFIED;
+    cclient->quote_pending = false;
     cclient->rsize = 5000;
     cclient->rbuffer = (unsigned char*) xmalloc(cclient->rsize);
 
@@ -311,6 +323,7 @@ callback_cmd(struct lws *wsi, enum lws_callback_reasons reason,
              void *user, void *in, size_t len) {
     struct cmd_client *cclient = (struct cmd_client *) user;
     int socket;
+    callback_scope scope("cmd", reason, len);
     switch (reason) {
     case LWS_CALLBACK_TIMER: // invoked from do_exit
             do_exit(0, false);
@@ -19,6 +19,8 @@
 #define PASS_STDFILES_SWITCH_TO_STDOUT '\002'
 // Send following bytes to stderr.
 #define PASS_STDFILES_SWITCH_TO_STDERR '\003'
+// Next byte is data, even if it is one of the above (or this) codes.
+#define PASS_STDFILES_QUOTE '\000'
 //#define PASS_STDFILES_SWITCH_TO_STDERR_STRING "\003"
 #else
 #define PASS_STDFILES_UNIX_SOCKET 1
@@ -26,6 +28,7 @@
 struct cmd_socket_client {
     int socket;
     int exit_code;
+    bool quote_pending; // last read ended with PASS_STDFILES_QUOTE
     size_t rsize;
     unsigned char *rbuffer;
 };
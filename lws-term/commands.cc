@@ -54,12 +54,10 @@ bool check_window_option(const std::string& option,
             slen > 1 && (s[0] == '#' || s[0] == ':') ? s[0] : '\0';
         bool matched = false;
         if (s != "") {
-            for (struct tty_client *tclient  = TCLIENT_FIRST;
-                 tclient != NULL; tclient = TCLIENT_NEXT(tclient)) {
-                if (tclient->window_name == s) {
-                    insert_window(windows, tclient, top_marker);
-                    matched = true;
-                }
+            auto range = windows_by_name.find(s);
+            for (auto it = range.first; it != range.second; it++) {
+                insert_window(windows, it->second, top_marker);
+                matched = true;
             }
         }
         if (! matched && s != "") {
@@ -438,9 +436,21 @@ int await_action(int argc, arglist_t argv, struct options *opts)
     json matches;
     int actions = 0;
     const char *close_response = nullptr;
+    const char *session_specifier = nullptr;
+    double timeout = -1;
+    const char *timeout_message = nullptr;
     for (int i = 1; i < argc; i++) {
         const char *arg = argv[i];
-        if (strstr(arg, "-w")) {
+        if (strncmp(arg, "-s", 2) == 0) {
+            if (strlen(arg) > 2) {
+                session_specifier = arg + 2;
+            } else if (i+1 < argc) {
+                session_specifier = argv[++i];
+            } else {
+                printf_error(opts, "missing argument following -s");
+                return EXIT_BAD_CMDARG;
+            }
+        } else if (strstr(arg, "-w")) {
             if (strlen(arg) > 2) {
                 woption = arg + 2;
             } else if (i+1 < argc) {
@@ -485,6 +495,8 @@ int await_action(int argc, arglist_t argv, struct options *opts)
             }
             request["timeout"] = tm;
             request["timeoutmsg"] = argv[i+2];
+            timeout = tm;
+            timeout_message = argv[i+2];
             i += 2;
             actions++;
         } else if (strcmp(arg, "--close") == 0) {
@@ -495,6 +507,25 @@ int await_action(int argc, arglist_t argv, struct options *opts)
             return EXIT_BAD_CMDARG;
         }
     }
+    if (session_specifier) {
+        // Match output in the server, without involving the front-end.
+        if (! woption.empty()) {
+            printf_error(opts, "domterm await: both -w (window) and -s (session) options");
+            return EXIT_BAD_CMDARG;
+        }
+        struct pty_client *pclient = find_session(session_specifier);
+        if (pclient == NULL) {
+            printf_error(opts, "domterm await: no session '%s' found",
+                         session_specifier);
+            return EXIT_FAILURE;
+        }
+        if (actions == 0 && ! close_response) {
+            printf_error(opts, "no await actions");
+            return EXIT_BAD_CMDARG;
+        }
+        return await_output_action(pclient, matches, timeout, timeout_message,
+                                   close_response, opts);
+    }
     if (woption.empty())
         woption = "^";
     int window = check_single_window_option(woption, "await", opts);
@@ -820,6 +851,7 @@ static void pclient_status_info(struct pty_client *pclient, FILE *out)
                         REMOTE_SESSIONNUMBER_KEY);
         if (! remote.empty())
             fprintf(out, "#%s", remote.c_str());
+        print_proxy_inflate_status(pclient, out);
     } else {
         fprintf(out, "pid: %d, tty: %s", pclient->pid, pclient->ttyname);
         if (pclient->use_xtermjs)
@@ -831,6 +863,10 @@ static void pclient_status_info(struct pty_client *pclient, FILE *out)
         fprintf(out, ", name: %s", pclient->session_name.c_str()); // FIXME-quote?
     if (pclient->paused)
         fprintf(out, ", paused");
+    fprintf(out, ", memory: %ldkB",
+            (long) ((pclient_memory_usage(pclient) + 1023) >> 10));
+    if (pclient->compacted)
+        fprintf(out, " (compacted)");
 }
 
 static void show_connection_info(struct tty_client *tclient,
@@ -870,6 +906,7 @@ static bool status_by_session(FILE * out, int verbosity)
                         fprintf(out, "  connection %d", number);
                     fprintf(out, " via ssh");
                     show_connection_info(tclient, out, verbosity);
+                    print_proxy_deflate_status(tclient, out);
                 } else {
                     if (number >= 0) {
                         fprintf(out, "  window %d", number);
@@ -1007,10 +1044,13 @@ int status_action(int argc, arglist_t argv, struct options *opts)
 {
     int verbosity = 0;
     bool by_session = false;
+    bool stalls = false;
     for (int i = 1; i < argc; i++) {
         const char *arg = argv[i];
         if (strcmp(arg, "--by-session") == 0)
             by_session = true;
+        else if (strcmp(arg, "--stalls") == 0)
+            stalls = true;
         else if (strcmp(arg, "--verbose") == 0)
             verbosity++;
     }
@@ -1033,6 +1073,10 @@ int status_action(int argc, arglist_t argv, struct options *opts)
     if (! have_clients)
         fprintf(out, in_server ? "(no domterm sessions or windows)\n"
                 : "(no domterm sessions or server)\n");
+    if (in_server && have_clients)
+        print_memory_status(out);
+    if (stalls && in_server && ! print_stalls(out))
+        fprintf(out, "(no stalls)\n");
     fclose(out);
     return EXIT_SUCCESS;
 }
@@ -1105,9 +1149,9 @@ int view_saved_action(int argc, arglist_t argv, struct options *opts)
     char *url = challoc(ulen);
     snprintf(url, ulen, "%s%s", fscheme, file);
     free(fencoded);
-    display_session(opts, NULL, url, saved_window);
+    int r = display_session(opts, NULL, url, saved_window);
     free(url);
-    return EXIT_SUCCESS;
+    return r;
 }
 
 int freshline_action(int argc, arglist_t argv, struct options *opts)
@@ -1197,6 +1241,59 @@ int reverse_video_action(int argc, arglist_t argv, struct options *opts)
                                 ".");
 }
 
+int debug_action(int argc, arglist_t argv, struct options *opts)
+{
+    const char *subcmd = argc < 2 ? "" : argv[1];
+    if (strcmp(subcmd, "dump-log") == 0) {
+        if (argc > 2) {
+            printf_error(opts, "too many arguments to debug dump-log");
+            return EXIT_BAD_CMDARG;
+        }
+        FILE *out = fdopen(dup(opts->fd_out), "w");
+        log_dump(out);
+        fclose(out);
+        return EXIT_SUCCESS;
+    }
+    if (strcmp(subcmd, "trace") == 0) {
+        const char *what = argc < 3 ? "" : argv[2];
+        if (strcmp(what, "start") == 0 && argc <= 4) {
+            std::string fname;
+            if (argc == 4) {
+                fname = argv[3];
+                if (fname[0] != '/' && opts->cwd)
+                    fname = std::string(opts->cwd) + "/" + fname;
+            } else
+                // Not in /tmp, where someone else could have put
+                // a symlink with the (predictable) name.
+                fname = std::string(domterm_socket_dir())
+                    + "/trace-" + std::to_string(getpid()) + ".json";
+            const char *err = trace_start(fname.c_str());
+            if (err) {
+                printf_error(opts, "cannot start trace to '%s': %s",
+                             fname.c_str(), err);
+                return EXIT_FAILURE;
+            }
+            dprintf(opts->fd_out, "Tracing to %s\n", fname.c_str());
+            return EXIT_SUCCESS;
+        }
+        if (strcmp(what, "stop") == 0 && argc == 3) {
+            char *fname = trace_stop();
+            if (fname == NULL) {
+                printf_error(opts, "not tracing");
+                return EXIT_FAILURE;
+            }
+            dprintf(opts->fd_out, "Trace written to %s\n", fname);
+            free(fname);
+            return EXIT_SUCCESS;
+        }
+        printf_error(opts, "usage: domterm debug trace start [FILE]|stop");
+        return EXIT_BAD_CMDARG;
+    }
+    printf_error(opts, argc < 2 ? "missing sub-command for debug"
+                 : "unknown debug sub-command '%s'", subcmd);
+    return EXIT_BAD_CMDARG;
+}
+
 int complete_action(int argc, arglist_t argv, struct options *opts)
 {
     if (argc != 6)
@@ -1586,6 +1683,12 @@ struct command commands[] = {
   { .name = "status",
     .options = COMMAND_IN_CLIENT_IF_NO_SERVER|COMMAND_IN_SERVER,
     .action = status_action },
+  { .name = "debug", .options = COMMAND_IN_EXISTING_SERVER,
+    .action = debug_action },
+  { .name = "watch", .options = COMMAND_IN_EXISTING_SERVER,
+    .action = watch_action },
+  { .name = "tail", .options = COMMAND_IN_EXISTING_SERVER,
+    .action = tail_action },
   { .name = "reverse-video", .options = COMMAND_IN_EXISTING_SERVER,
     .action = reverse_video_action },
   { .name = "help",
@@ -1627,6 +1730,8 @@ struct command commands[] = {
     .action = settings_action },
   { .name = COMPLETE_FOR_BASH_CMD, .options = COMMAND_IN_CLIENT,
     .action = complete_action },
+  { .name = "upgrade-server", .options = COMMAND_IN_EXISTING_SERVER,
+    .action = upgrade_server_action },
   { .name = "kill-server",
     .options = COMMAND_IN_CLIENT_IF_NO_SERVER|COMMAND_IN_SERVER,
     .action = kill_server_action },
@@ -749,7 +749,7 @@ display_session(struct options *options, struct pty_client *pclient,
       if (pclient != NULL && strcmp(browser_specifier, "--detached") == 0) {
           pclient->detach_count = 1;
           if (has_name)
-              pclient->session_name = options->name_option;
+              pclient->set_session_name(options->name_option);
           options->browser_command = "";
           pclient->start_if_needed(options);
           return EXIT_SUCCESS;
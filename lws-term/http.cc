@@ -174,6 +174,7 @@ callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user, voi
     struct http_client *hclient = (struct http_client *) user;
     unsigned char buffer[LBUFSIZE + LWS_PRE], *p, *end;
     char buf[256];
+    callback_scope scope("http", reason, len);
 
     switch (reason) {
     case LWS_CALLBACK_HTTP: {
@@ -253,6 +254,7 @@ callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user, voi
                                            "<b>missing or bad server key</b>");
                     goto try_to_reuse;
                 }
+                trace_operation(is_saved_file ? "saved-file" : "get-file");
                 FILE *sfile = NULL;
                 struct stat stbuf;
                 off_t slen;
@@ -0,0 +1,148 @@
+#ifndef ID_TABLE_H
+#define ID_TABLE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+/* Indexes of entries in the id_tables of windows and sessions
+ * must not collide (see avoid_index).  These check all such tables;
+ * they are defined in protocol.cc. */
+extern bool id_tables_valid_index(int i);
+extern uint64_t id_tables_used_word(size_t w);
+
+// Assume each T has an index()  method that returns a unique positive integer.
+// This table manages the mapping between T and those indexes.
+template<typename T>
+class id_table {
+    // Invariant for elements array
+    // If SNUM is valid then elements[SNUM].index() == SNUM.
+    // Otherwise (if SNUM is < sz): elements[SNUM] points
+    // to nullptr or the next valid element in elements.
+    T** elements = nullptr;
+    int sz = 0;
+    // Bit I of used (as 64-bit words) is set iff index I is in use.
+    std::vector<uint64_t> used;
+    void set_used(int i, bool value) {
+        size_t w = i >> 6;
+        if (w >= used.size())
+            used.resize(w + 1, 0);
+        if (value)
+            used[w] |= (uint64_t) 1 << (i & 63);
+        else
+            used[w] &= ~((uint64_t) 1 << (i & 63));
+    }
+public:
+    uint64_t used_word(size_t w) const {
+        return w < used.size() ? used[w] : 0;
+    }
+    T* first() { return elements == nullptr ? nullptr : elements[1]; }
+    T* next(T* entry) { return elements[entry->index()+1]; }
+    T*& operator[](int i) { return elements[i]; } // fast/unsafe lookup
+    int enter(T* entry, int hint);
+    void remove(T* entry);
+    bool valid_index(int i) {
+        return i > 0 && i < sz && elements[i] != nullptr
+            && elements[i]->index() == i;
+    }
+    bool avoid_index(int i, int hint);
+    int next_free_index(int i);
+    T* operator()(int i) { return valid_index(i) ? elements[i] : nullptr; }
+};
+
+// Map from (not necessarily unique) name to the entries with that name.
+template<typename T>
+class name_index {
+    std::unordered_multimap<std::string, T*> map;
+public:
+    typedef typename std::unordered_multimap<std::string, T*>::const_iterator
+    iterator;
+    void enter(const std::string& name, T* entry) {
+        if (! name.empty())
+            map.emplace(name, entry);
+    }
+    void remove(const std::string& name, T* entry) {
+        auto range = map.equal_range(name);
+        for (auto it = range.first; it != range.second; it++) {
+            if (it->second == entry) {
+                map.erase(it);
+                break;
+            }
+        }
+    }
+    std::pair<iterator, iterator> find(const std::string& name) const {
+        return map.equal_range(name);
+    }
+    size_t count(const std::string& name) const { return map.count(name); }
+};
+
+template<typename T>
+bool id_table<T>::avoid_index(int i, int hint) {
+    return valid_index(i) || (i != hint && id_tables_valid_index(i));
+}
+
+// Return first index >= i not used in this table or the tables
+// checked by id_tables_used_word.  Uses the 'used' bitmaps, a word at a time.
+template<typename T>
+int id_table<T>::next_free_index(int i)
+{
+    for (size_t w = i >> 6; ; w++) {
+        uint64_t busy = used_word(w) | id_tables_used_word(w);
+        if (w == (size_t) (i >> 6))
+            busy |= ((uint64_t) 1 << (i & 63)) - 1; // ignore bits below i
+        if (~busy != 0)
+            return (int) (w << 6) + __builtin_ctzll(~busy);
+    }
+}
+
+template<typename T>
+int id_table<T>::enter(T *entry, int hint)
+{
+    int snum;
+    if (hint > 0 && ! valid_index(hint))
+        snum = hint;
+    else {
+        snum = next_free_index(1);
+        // The bitmaps should agree with avoid_index, but be safe.
+        while (avoid_index(snum, hint))
+            snum = next_free_index(snum + 1);
+    }
+    if (snum >= sz) {
+        int newsize = 3 * sz >> 1;
+        if (newsize < 20)
+            newsize = 20;
+        if (newsize <= snum)
+            newsize = snum + 1;
+        elements = (T**) realloc(elements, newsize * sizeof(T*));
+        for (int i = sz; i < newsize; i++)
+            elements[i] = nullptr;
+        sz = newsize;
+    }
+    T*next = elements[snum];
+    // Maintain invariant
+    for (int iprev = snum;
+         --iprev >= 0 && elements[iprev] == next; ) {
+        elements[iprev] = entry;
+    }
+    elements[snum] = entry;
+    set_used(snum, true);
+    return snum;
+}
+
+template<typename T>
+void id_table<T>::remove(T* entry)
+{
+    if (entry == nullptr)
+        return;
+    int index = entry->index();
+    if (! valid_index(index))
+        return;
+    set_used(index, false);
+    T* next = index + 1 < sz ? elements[index+1] : nullptr;
+    for (; index >= 0 && elements[index] == entry; index--)
+            elements[index] = next;
+}
+
+#endif /* ID_TABLE_H */
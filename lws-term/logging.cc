@@ -0,0 +1,309 @@
+/* Logging without slowing down the server.
+ *
+ * Writing each log message directly to the log file (with an fflush)
+ * is too slow for the paths that handle every chunk of pty output or
+ * input.  Instead, messages are added to a ring buffer, and a writer
+ * thread formats them and writes them out.
+ *
+ * The ring has a single producer (the lws loop thread) and a single
+ * consumer (whoever holds log_mutex - normally the writer thread), so it
+ * needs no lock on the producer side.  If the ring is full the message
+ * is dropped (and counted), rather than waiting for the writer.
+ * An idle writer sleeps on log_wakeup; the producer only takes
+ * log_wait_mutex (to signal it) when the writer is actually asleep.
+ *
+ * Messages from lws (lwsl_notice etc) are already formatted, so we save
+ * a copy of the text.  Messages logged using dtlog just save the format
+ * and (up to 5) integer arguments - formatting is done by the writer.
+ *
+ * The most recent formatted messages are also kept in memory,
+ * for 'domterm debug dump-log'.
+ */
+
+#include "server.h"
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <time.h>
+
+#define LOG_RING_SIZE 4096 /* must be a power of 2 */
+#define LOG_HISTORY_MAX 65536
+
+struct log_entry {
+    struct timespec time;
+    int level;
+    const char *format; // string literal, or NULL if text is set
+    char *text; // malloc'ed formatted message
+    long args[5];
+};
+
+int log_levels = 0;
+static struct log_entry log_ring[LOG_RING_SIZE];
+static std::atomic<size_t> log_head(0); // next entry to write
+static std::atomic<size_t> log_tail(0); // next entry to format
+static std::atomic<long> log_dropped(0);
+static std::atomic<bool> log_stop(false);
+static bool log_thread_running = false;
+static pthread_t log_thread;
+static std::mutex log_mutex;
+static std::mutex log_wait_mutex;
+static std::condition_variable log_wakeup;
+static std::atomic<bool> log_writer_sleeping(false);
+static FILE *log_out = NULL;
+static bool log_timestamps = true;
+static bool log_in_child = false;
+static sbuf log_history;
+
+static struct log_entry *
+log_reserve(int level)
+{
+    size_t head = log_head.load(std::memory_order_relaxed);
+    if (head - log_tail.load(std::memory_order_acquire) >= LOG_RING_SIZE) {
+        log_dropped.fetch_add(1, std::memory_order_relaxed);
+        return NULL;
+    }
+    struct log_entry *e = &log_ring[head & (LOG_RING_SIZE - 1)];
+    clock_gettime(CLOCK_REALTIME, &e->time);
+    e->level = level;
+    return e;
+}
+
+static void log_start_thread();
+
+static void
+log_wake_writer()
+{
+    std::lock_guard<std::mutex> lock(log_wait_mutex);
+    log_wakeup.notify_one();
+}
+
+static void
+log_commit()
+{
+    // Sequentially consistent, so either the writer sees the new entry
+    // before going to sleep, or we see that it is sleeping.
+    log_head.fetch_add(1);
+    if (! log_thread_running)
+        log_start_thread();
+    else if (log_writer_sleeping.load())
+        log_wake_writer();
+}
+
+static const char *
+log_level_name(int level)
+{
+    switch (level) {
+    case LLL_ERR: return "E";
+    case LLL_WARN: return "W";
+    case LLL_NOTICE: return "N";
+    case LLL_INFO: return "I";
+    case LLL_DEBUG: return "D";
+    default: return "?";
+    }
+}
+
+// Format one entry into sb.
+static void
+log_format(struct log_entry *e, sbuf& sb)
+{
+    if (log_timestamps) {
+        struct tm tm;
+        localtime_r(&e->time.tv_sec, &tm);
+        sb.printf("[%04d/%02d/%02d %02d:%02d:%02d:%04d] %s: ",
+                  tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+                  tm.tm_hour, tm.tm_min, tm.tm_sec,
+                  (int) (e->time.tv_nsec / 100000),
+                  log_level_name(e->level));
+    }
+    if (e->format)
+        sb.printf(e->format, e->args[0], e->args[1], e->args[2],
+                  e->args[3], e->args[4]);
+    else {
+        sb.append(e->text);
+        free(e->text);
+        e->text = NULL;
+    }
+}
+
+// Format and write out pending entries.  Caller must hold log_mutex.
+// Returns the number of entries handled.
+static size_t
+log_drain_locked()
+{
+    size_t tail = log_tail.load(std::memory_order_relaxed);
+    size_t head = log_head.load(std::memory_order_acquire);
+    size_t count = head - tail;
+    if (count == 0 && log_dropped.load(std::memory_order_relaxed) == 0)
+        return 0;
+    sbuf sb;
+    long dropped = log_dropped.exchange(0, std::memory_order_relaxed);
+    if (dropped > 0)
+        sb.printf("(log buffer full - %ld messages dropped)\n", dropped);
+    for (; tail != head; tail++) {
+        log_format(&log_ring[tail & (LOG_RING_SIZE - 1)], sb);
+        log_tail.store(tail + 1, std::memory_order_release);
+    }
+    if (log_out) {
+        fwrite(sb.buffer, 1, sb.len, log_out);
+        fflush(log_out);
+    }
+    if (log_history.len + sb.len > LOG_HISTORY_MAX) {
+        size_t excess = log_history.len + sb.len - LOG_HISTORY_MAX;
+        if (excess >= log_history.len)
+            log_history.len = 0;
+        else {
+            // Only keep complete lines.
+            const char *nl = (const char *)
+                memchr(log_history.buffer + excess, '\n',
+                       log_history.len - excess);
+            excess = nl ? nl + 1 - log_history.buffer : log_history.len;
+            log_history.erase(0, excess);
+        }
+    }
+    if (sb.len > LOG_HISTORY_MAX)
+        log_history.append(sb.buffer + sb.len - LOG_HISTORY_MAX,
+                           LOG_HISTORY_MAX);
+    else
+        log_history.append(sb);
+    return count;
+}
+
+static void *
+log_writer(void *)
+{
+    for (;;) {
+        bool stopping = log_stop.load();
+        size_t n;
+        {
+            std::lock_guard<std::mutex> lock(log_mutex);
+            n = log_drain_locked();
+        }
+        if (stopping)
+            break;
+        if (n == 0) {
+            std::unique_lock<std::mutex> lock(log_wait_mutex);
+            log_writer_sleeping = true;
+            log_wakeup.wait(lock, [] {
+                return log_stop.load()
+                    || log_head.load() != log_tail.load()
+                    || log_dropped.load() != 0;
+            });
+            log_writer_sleeping = false;
+        }
+    }
+    return NULL;
+}
+
+static void
+log_start_thread()
+{
+    if (log_in_child)
+        return;
+    log_stop = false;
+    log_thread_running =
+        pthread_create(&log_thread, NULL, log_writer, NULL) == 0;
+}
+
+/** Write out everything logged so far, and stop the writer thread.
+ * (It is restarted by the next message.)
+ * Needed before exit or fork (daemonize). */
+void
+log_flush()
+{
+    if (log_in_child)
+        return;
+    if (log_thread_running) {
+        log_stop = true;
+        log_wake_writer();
+        pthread_join(log_thread, NULL);
+        log_thread_running = false;
+    } else {
+        std::lock_guard<std::mutex> lock(log_mutex);
+        log_drain_locked();
+    }
+}
+
+static void
+log_after_fork_child()
+{
+    // The writer thread does not exist in a forked child, and log_mutex
+    // may be locked.  So just write directly.
+    log_in_child = true;
+    log_thread_running = false;
+}
+
+/** Called in the server process after it has forked to become a daemon.
+ * (log_flush should be called before the fork.) */
+void
+log_after_daemonize()
+{
+    log_in_child = false;
+}
+
+/** Save a message using a format string and up to 5 long arguments.
+ * Normally called using the dtlog macro. */
+void
+log_record(int level, const char *format,
+           long a0, long a1, long a2, long a3, long a4)
+{
+    if (log_in_child) {
+        if (log_out)
+            fprintf(log_out, format, a0, a1, a2, a3, a4);
+        return;
+    }
+    struct log_entry *e = log_reserve(level);
+    if (e == NULL)
+        return;
+    e->format = format;
+    e->text = NULL;
+    e->args[0] = a0;
+    e->args[1] = a1;
+    e->args[2] = a2;
+    e->args[3] = a3;
+    e->args[4] = a4;
+    log_commit();
+}
+
+// Used as lws log emitter.
+static void
+log_emit(int level, const char *line)
+{
+    if (log_in_child) {
+        if (log_out)
+            fputs(line, log_out);
+        return;
+    }
+    struct log_entry *e = log_reserve(level);
+    if (e == NULL)
+        return;
+    e->format = NULL;
+    e->text = strdup(line);
+    log_commit();
+}
+
+/** Start logging messages whose level is in levels to out
+ * (which may be NULL, in which case messages are only kept in memory). */
+void
+log_setup(int levels, FILE *out, bool timestamps)
+{
+    static bool initialized = false;
+    log_flush();
+    log_levels = levels;
+    log_out = out;
+    log_timestamps = timestamps;
+    lws_set_log_level(levels, levels == 0 ? NULL : log_emit);
+    if (! initialized) {
+        initialized = true;
+        pthread_atfork(NULL, NULL, log_after_fork_child);
+        atexit(log_flush);
+    }
+}
+
+/** Write the most recent log messages to out. */
+void
+log_dump(FILE *out)
+{
+    std::lock_guard<std::mutex> lock(log_mutex);
+    log_drain_locked();
+    fwrite(log_history.buffer, 1, log_history.len, out);
+}
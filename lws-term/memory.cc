@@ -0,0 +1,426 @@
+/* Keeping the memory used for sessions within a budget.
+ *
+ * So that a window can be re-attached, each session keeps
+ * saved_window_contents (the window state from the last WINDOW-CONTENTS
+ * request) and preserved_output (output since then).  Each window of a
+ * session also has input and output buffers.  With many long-lived
+ * sessions this can add up.
+ *
+ * If the memory.budget setting (in megabytes) is set, and the total for
+ * all sessions is over the budget, memory is reclaimed from idle sessions
+ * (no input or output for MEMORY_IDLE_USEC), least recently active first:
+ * 1. Shrink the (empty) input and output buffers of their windows.
+ * 2. Compress (using zlib) the saved window contents and preserved output.
+ *    These are uncompressed again by memory_restore when they are needed.
+ * 3. If still over budget, discard the oldest preserved output,
+ *    keeping only the last MEMORY_EVICT_KEEP bytes.
+ *
+ * 'domterm status' shows the memory used by each session.
+ */
+
+#include "server.h"
+#include <zlib.h>
+#include <algorithm>
+
+#define MEMORY_CHECK_USEC 1000000 /* check at most once a second */
+#define MEMORY_IDLE_USEC 30000000 /* idle after 30 seconds */
+#define MEMORY_EVICT_KEEP 16384
+#define MEMORY_IDLE_OB_SIZE 256
+
+// Compressed state of an idle session.
+struct memory_compacted {
+    char *window; // compressed saved_window_contents, or NULL
+    size_t window_clength;
+    size_t window_length; // uncompressed, not counting the final '\0'
+    char *preserved; // compressed preserved_output, or NULL
+    size_t preserved_clength;
+    size_t preserved_length;
+};
+
+static size_t memory_budget = 0; // bytes; 0 means unlimited
+static long memory_last_check_us = 0;
+static long memory_compactions = 0;
+static long memory_evicted = 0; // total bytes of preserved output discarded
+
+/** Update the budget from the memory.budget setting. */
+void
+memory_settings_update()
+{
+    json settings;
+    merge_settings(settings, main_options->cmd_settings);
+    double mb = get_setting_d(settings, "memory.budget", 0);
+    memory_budget = mb <= 0 ? 0 : (size_t) (mb * 1024 * 1024);
+}
+
+static size_t
+sbuf_allocated(const sbuf& sb)
+{
+    return sb.buffer == NULL ? 0 : sb.headroom + sb.size;
+}
+
+/** Bytes used by pclient's saved state and windows' buffers. */
+size_t
+pclient_memory_usage(struct pty_client *pclient)
+{
+    size_t total = 0;
+    if (pclient->saved_window_contents)
+        total += strlen(pclient->saved_window_contents) + 1;
+    if (pclient->preserved_output)
+        total += pclient->preserved_size;
+    struct memory_compacted *mc = pclient->compacted;
+    if (mc)
+        total += mc->window_clength + mc->preserved_clength;
+    FOREACH_WSCLIENT(tclient, pclient) {
+        total += sbuf_allocated(tclient->ob) + sbuf_allocated(tclient->inb);
+    }
+    return total;
+}
+
+// Compress data; returns NULL if it doesn't save at least a quarter.
+static char *
+memory_compress(const char *data, size_t length, size_t *clength)
+{
+    uLongf clen = compressBound(length);
+    char *cbuf = (char *) xmalloc(clen);
+    if (compress2((Bytef *) cbuf, &clen, (const Bytef *) data, length,
+                  Z_BEST_SPEED) != Z_OK
+        || clen > length - (length >> 2)) {
+        free(cbuf);
+        return NULL;
+    }
+    *clength = clen;
+    return (char *) xrealloc(cbuf, clen);
+}
+
+static void
+memory_uncompress(char *out, size_t length,
+                  const char *cdata, size_t clength)
+{
+    uLongf dlen = length;
+    if (uncompress((Bytef *) out, &dlen, (const Bytef *) cdata, clength)
+        != Z_OK || dlen != length) {
+        // Should not happen.  Better garbage in the window than a crash.
+        lwsl_err("memory: failed to uncompress saved session state\n");
+        memset(out, ' ', length);
+    }
+}
+
+static struct memory_compacted *
+memory_compacted_for(struct pty_client *pclient)
+{
+    if (pclient->compacted == NULL)
+        pclient->compacted = new memory_compacted();
+    return pclient->compacted;
+}
+
+static void
+memory_compacted_check_empty(struct pty_client *pclient)
+{
+    struct memory_compacted *mc = pclient->compacted;
+    if (mc && mc->window == NULL && mc->preserved == NULL) {
+        delete mc;
+        pclient->compacted = NULL;
+    }
+}
+
+/** Compress saved_window_contents.  Returns the number of bytes saved. */
+size_t
+memory_compact_window(struct pty_client *pclient)
+{
+    if (pclient->saved_window_contents == NULL)
+        return 0;
+    size_t wlen = strlen(pclient->saved_window_contents);
+    size_t clen;
+    char *cdata = memory_compress(pclient->saved_window_contents, wlen, &clen);
+    if (cdata == NULL)
+        return 0;
+    struct memory_compacted *mc = memory_compacted_for(pclient);
+    free(mc->window); // should be NULL
+    mc->window = cdata;
+    mc->window_clength = clen;
+    mc->window_length = wlen;
+    free(pclient->saved_window_contents);
+    pclient->saved_window_contents = NULL;
+    return wlen + 1 - clen;
+}
+
+static size_t
+memory_compact_preserved(struct pty_client *pclient)
+{
+    if (pclient->preserved_output == NULL)
+        return 0;
+    size_t plen = pclient->preserved_end - pclient->preserved_start;
+    size_t clen;
+    char *cdata = memory_compress(pclient->preserved_output
+                                  + pclient->preserved_start, plen, &clen);
+    if (cdata == NULL)
+        return 0;
+    struct memory_compacted *mc = memory_compacted_for(pclient);
+    mc->preserved = cdata;
+    mc->preserved_clength = clen;
+    mc->preserved_length = plen;
+    size_t saved = pclient->preserved_size - clen;
+    free(pclient->preserved_output);
+    pclient->preserved_output = NULL;
+    return saved;
+}
+
+// Compress pclient's saved state.  Returns the number of bytes saved.
+static size_t
+memory_compact(struct pty_client *pclient)
+{
+    size_t saved = memory_compact_window(pclient)
+        + memory_compact_preserved(pclient);
+    if (saved > 0) {
+        memory_compactions++;
+        dtlog(LLL_INFO, "memory: compacted session %ld, saved %ld bytes\n",
+              (long) pclient->session_number, (long) saved);
+    }
+    return saved;
+}
+
+/** Uncompress state compressed by memory_compact.
+ * Normally called using the memory_restore inline functions. */
+void
+memory_restore_compacted(struct pty_client *pclient,
+                         bool window, bool preserved)
+{
+    struct memory_compacted *mc = pclient->compacted;
+    if (window && mc->window) {
+        char *w = challoc(mc->window_length + 1);
+        memory_uncompress(w, mc->window_length,
+                          mc->window, mc->window_clength);
+        w[mc->window_length] = '\0';
+        free(pclient->saved_window_contents); // should be NULL
+        pclient->saved_window_contents = w;
+        free(mc->window);
+        mc->window = NULL;
+        mc->window_clength = 0;
+    }
+    if (preserved && mc->preserved) {
+        size_t plen = mc->preserved_length;
+        char *p = (char *) xmalloc(plen);
+        memory_uncompress(p, plen, mc->preserved, mc->preserved_clength);
+        free(pclient->preserved_output); // should be NULL
+        pclient->preserved_output = p;
+        pclient->preserved_start = 0;
+        pclient->preserved_end = plen;
+        pclient->preserved_size = plen;
+        free(mc->preserved);
+        mc->preserved = NULL;
+        mc->preserved_clength = 0;
+    }
+    memory_compacted_check_empty(pclient);
+}
+
+/** True if there is a saved window snapshot (possibly compressed)
+ * to send to a new window. */
+bool
+pclient_has_saved_window(struct pty_client *pclient)
+{
+    if (pclient->saved_window_is_base)
+        return false;
+    return pclient->saved_window_contents != NULL
+        || (pclient->compacted && pclient->compacted->window);
+}
+
+/** Length of the saved window snapshot (uncompressed). */
+size_t
+saved_window_length(struct pty_client *pclient)
+{
+    if (pclient->saved_window_contents)
+        return strlen(pclient->saved_window_contents);
+    if (pclient->compacted && pclient->compacted->window)
+        return pclient->compacted->window_length;
+    return 0;
+}
+
+/** Free saved_window_contents (compressed or not). */
+void
+memory_discard_window(struct pty_client *pclient)
+{
+    free(pclient->saved_window_contents);
+    pclient->saved_window_contents = NULL;
+    pclient->saved_window_is_base = false;
+    struct memory_compacted *mc = pclient->compacted;
+    if (mc && mc->window) {
+        free(mc->window);
+        mc->window = NULL;
+        mc->window_clength = 0;
+        memory_compacted_check_empty(pclient);
+    }
+}
+
+/** If the saved window is compressed, append it to sb, as 'z' followed
+ * by the base64 encoding of the zlib data, for the \e]103 sequence.
+ * Returns false (and does nothing) if it isn't compressed. */
+bool
+snapshot_append_compressed(struct pty_client *pclient, sbuf& sb)
+{
+    struct memory_compacted *mc = pclient->compacted;
+    if (mc == NULL || mc->window == NULL)
+        return false;
+    char *b64 = base64_encode((const unsigned char *) mc->window,
+                              mc->window_clength);
+    sb.append("z");
+    sb.append(b64);
+    free(b64);
+    return true;
+}
+
+/** Free compressed state (when the session is closed). */
+void
+memory_release(struct pty_client *pclient)
+{
+    struct memory_compacted *mc = pclient->compacted;
+    if (mc == NULL)
+        return;
+    pclient->compacted = NULL;
+    free(mc->window);
+    free(mc->preserved);
+    delete mc;
+}
+
+// Shrink the buffers of an idle session's windows.
+// Returns the number of bytes saved.
+static size_t
+memory_shrink_buffers(struct pty_client *pclient)
+{
+    size_t saved = 0;
+    FOREACH_WSCLIENT(tclient, pclient) {
+        if (tclient->inb.buffer != NULL && tclient->inb.data_length() == 0) {
+            saved += sbuf_allocated(tclient->inb);
+            tclient->inb.reset();
+        }
+        // A NULL ob.buffer has a special meaning (see handle_output),
+        // so keep a small buffer.
+        sbuf& ob = tclient->ob;
+        if (ob.buffer != NULL && ob.len == 0
+            && ob.size > MEMORY_IDLE_OB_SIZE) {
+            saved += ob.size - MEMORY_IDLE_OB_SIZE;
+            ob.reset();
+            ob.extend(MEMORY_IDLE_OB_SIZE);
+        }
+    }
+    return saved;
+}
+
+// Discard all but the last MEMORY_EVICT_KEEP bytes of preserved output,
+// starting at a line boundary if possible.
+// Returns the number of bytes saved.
+static size_t
+memory_evict(struct pty_client *pclient)
+{
+    memory_restore_preserved(pclient);
+    if (pclient->preserved_output == NULL)
+        return 0;
+    size_t plen = pclient->preserved_end - pclient->preserved_start;
+    if (plen <= MEMORY_EVICT_KEEP)
+        return 0;
+    const char *start = pclient->preserved_output + pclient->preserved_start;
+    const char *keep = start + plen - MEMORY_EVICT_KEEP;
+    const char *nl = (const char *)
+        memchr(keep, '\n', MEMORY_EVICT_KEEP / 2);
+    if (nl)
+        keep = nl + 1;
+    size_t dropped = keep - start;
+    size_t kept = plen - dropped;
+    size_t old_size = pclient->preserved_size;
+    char *p = (char *) xmalloc(kept);
+    memcpy(p, keep, kept);
+    free(pclient->preserved_output);
+    pclient->preserved_output = p;
+    pclient->preserved_start = 0;
+    pclient->preserved_end = kept;
+    pclient->preserved_size = kept;
+    pclient->preserved_sent_count =
+        (pclient->preserved_sent_count + dropped) & MASK28;
+    pclient->history_evicted = true;
+    memory_evicted += dropped;
+    lwsl_notice("memory: discarded %ld bytes of old output from session %d\n",
+                (long) dropped, pclient->session_number);
+    return old_size > kept ? old_size - kept : 0;
+}
+
+static long
+pclient_last_active(struct pty_client *pclient)
+{
+    return std::max(pclient->last_input_us, pclient->last_output_us);
+}
+
+static bool
+pclient_is_idle(struct pty_client *pclient, long now)
+{
+    if (now - pclient_last_active(pclient) < MEMORY_IDLE_USEC)
+        return false;
+    FOREACH_WSCLIENT(tclient, pclient) {
+        if (tclient->ob.len > 0 || tclient->requesting_contents == 2)
+            return false;
+    }
+    return true;
+}
+
+/** Called from the main loop.
+ * If we're over memory.budget, reclaim memory from idle sessions. */
+void
+memory_check()
+{
+    if (memory_budget == 0)
+        return;
+    long now = monotonic_usec();
+    if (now - memory_last_check_us < MEMORY_CHECK_USEC)
+        return;
+    memory_last_check_us = now;
+    size_t total = 0;
+    std::vector<struct pty_client *> idle;
+    FOREACH_PCLIENT(pclient) {
+        total += pclient_memory_usage(pclient);
+        if (pclient_is_idle(pclient, now))
+            idle.push_back(pclient);
+    }
+    if (total <= memory_budget || idle.empty())
+        return;
+    std::sort(idle.begin(), idle.end(),
+              [](struct pty_client *a, struct pty_client *b) {
+                  return pclient_last_active(a) < pclient_last_active(b);
+              });
+    for (auto pclient : idle) {
+        if (total <= memory_budget)
+            return;
+        total -= std::min(total, memory_shrink_buffers(pclient));
+    }
+    for (auto pclient : idle) {
+        if (total <= memory_budget)
+            return;
+        total -= std::min(total, memory_compact(pclient));
+    }
+    for (auto pclient : idle) {
+        if (total <= memory_budget)
+            return;
+        total -= std::min(total, memory_evict(pclient));
+        // Keep what is left compressed.
+        total -= std::min(total, memory_compact(pclient));
+    }
+    if (total > memory_budget)
+        dtlog(LLL_INFO, "memory: still using %ld bytes (budget %ld)\n",
+              (long) total, (long) memory_budget);
+}
+
+/** Print the total memory used by sessions, for 'domterm status'. */
+void
+print_memory_status(FILE *out)
+{
+    size_t total = 0;
+    FOREACH_PCLIENT(pclient) {
+        total += pclient_memory_usage(pclient);
+    }
+    fprintf(out, "Session memory: %ld kB", (long) ((total + 1023) >> 10));
+    if (memory_budget > 0)
+        fprintf(out, " (budget %ld kB)", (long) (memory_budget >> 10));
+    if (memory_compactions > 0)
+        fprintf(out, ", %ld compactions", memory_compactions);
+    if (memory_evicted > 0)
+        fprintf(out, ", %ld kB of old output discarded",
+                (memory_evicted + 1023) >> 10);
+    fprintf(out, "\n");
+}
@@ -2,12 +2,19 @@
 /*#define OPTION_MISC_TYPE*/
 OPTION_S(browser_default, "browser.default", OPTION_MISC_TYPE)
 OPTION_S(shell_command, "shell.default", OPTION_MISC_TYPE)
+OPTION_S(shell_prewarm, "shell.prewarm", OPTION_NUMBER_TYPE)
+OPTION_S(output_collapse_rate, "output.collapse-rate", OPTION_NUMBER_TYPE)
+OPTION_S(output_collapse_delay, "output.collapse-delay", OPTION_NUMBER_TYPE)
+OPTION_S(output_collapse_tail, "output.collapse-tail", OPTION_NUMBER_TYPE)
+OPTION_S(memory_budget, "memory.budget", OPTION_NUMBER_TYPE)
 OPTION_S(command_firefox, "command.firefox", OPTION_MISC_TYPE)
 OPTION_S(command_chrome, "command.chrome", OPTION_MISC_TYPE)
 OPTION_S(command_electron, "command.electron", OPTION_MISC_TYPE)
 OPTION_S(command_headless, "command.headless", OPTION_MISC_TYPE)
 OPTION_S(command_ssh, "command.ssh", OPTION_MISC_TYPE)
 OPTION_S(command_remote_domterm, "command.remote-domterm", OPTION_MISC_TYPE)
+OPTION_S(remote_compress, "remote-compress", OPTION_MISC_TYPE)
+OPTION_S(remote_multiplex, "remote-multiplex", OPTION_MISC_TYPE)
 OPTION_S(command_get_clipboard, "command.get-clipboard", OPTION_MISC_TYPE)
 OPTION_S(command_get_selection, "command.get-selection", OPTION_MISC_TYPE)
 OPTION_S(window_geometry, "window.geometry", OPTION_MISC_TYPE)
@@ -18,10 +25,10 @@ OPTION_S(log_file, "log.file", OPTION_STRING_TYPE)
 OPTION_S(titlebar, "titlebar", OPTION_STRING_TYPE)
 OPTION_S(subwindows, "subwindows", OPTION_STRING_TYPE)
 #if WITH_XTERMJS
-OPTION_S(xtermimal, "xtermjs", OPTION_MISC_TYPE)
+OPTION_S(xtermjs, "xtermjs", OPTION_MISC_TYPE)
 #endif
 #if WITH_GHOSTTY
-OPTION_S(ghtermimal, "ghostty", OPTION_MISC_TYPE)
+OPTION_S(ghostty, "ghostty", OPTION_MISC_TYPE)
 #endif
 
 /* front-end options */
@@ -55,6 +62,7 @@ OPTION_F(keymap_master, "keymap.master", OPTION_MISC_TYPE)
 OPTION_F(keymap_line_edit, "keymap.line-edit", OPTION_MISC_TYPE)
 OPTION_F(output_byte_by_byte, "output-byte-by-byte", OPTION_MISC_TYPE)
 OPTION_F(debug_input_extra_delay, "debug.input.extra-delay", OPTION_NUMBER_TYPE)
+OPTION_S(debug_stall_threshold, "debug.stall-threshold", OPTION_NUMBER_TYPE)
 OPTION_F(predicted_input_timeout, "predicted-input-timeout", OPTION_NUMBER_TYPE)
 OPTION_F(history_storage_key, "history.storage-key", OPTION_STRING_TYPE)
 OPTION_F(history_storage_max, "history.storage-max", OPTION_NUMBER_TYPE)
@@ -78,5 +86,8 @@ OPTION_F(remote_input_timeout, "remote-input-timeout", OPTION_NUMBER_TYPE)
 OPTION_F(remote_output_interval, "remote-output-interval", OPTION_NUMBER_TYPE)
 /** Browser times out if no output received from remote server */
 OPTION_F(remote_output_timeout, "remote-output-timeout", OPTION_NUMBER_TYPE)
+/** Number of times to automatically re-connect to a remote session
+ * after the ssh connection is lost. */
+OPTION_F(remote_reconnect, "remote-reconnect", OPTION_NUMBER_TYPE)
 OPTION_F(window_scale, "window-scale", OPTION_NUMBER_TYPE)
 OPTION_F(pane_scale, "pane-scale", OPTION_NUMBER_TYPE)
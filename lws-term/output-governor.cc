@@ -0,0 +1,200 @@
+/* Governor for runaway output.
+ *
+ * If a process writes output faster than output.collapse-rate (bytes per
+ * second) for output.collapse-delay seconds (an accidental 'cat' of a
+ * binary file, or a logging loop), sending it all to the browser
+ * is pointless and may kill the browser tab.  Instead, we "collapse"
+ * the session: keep reading from the pty, but discard the output,
+ * except for the last output.collapse-tail bytes.  Once a second
+ * a summary line is sent.  When the rate drops, we send the saved
+ * tail (normally the final screenful) and resume normal output.
+ *
+ * Remote (ssh) sessions are governed by the remote server.
+ */
+
+#include "server.h"
+
+#define GOVERNOR_WINDOW_US 1000000 /* measure rate over 1-second windows */
+
+struct output_governor {
+    long window_start_us;
+    long window_bytes;
+    int strikes; // consecutive windows above the limit
+    long discarded; // bytes discarded since collapsing
+    sbuf tail; // end of discarded output
+    struct wheel_timer timer; // while collapsed, once per window
+};
+
+static double governor_rate = 0; // bytes per second; 0 means disabled
+static int governor_delay = 2;
+static long governor_tail = 8192;
+
+/** Update limits from output.collapse-* settings. */
+void
+governor_settings_update()
+{
+    json settings;
+    merge_settings(settings, main_options->cmd_settings);
+    governor_rate = get_setting_d(settings, "output.collapse-rate", 0);
+    double d = get_setting_d(settings, "output.collapse-delay", 2);
+    governor_delay = d < 1 ? 1 : (int) d;
+    d = get_setting_d(settings, "output.collapse-tail", 8192);
+    governor_tail = d < 0 ? 0 : (long) d;
+}
+
+static void
+governor_summary(struct pty_client *pclient, const char *what)
+{
+    struct output_governor *gov = pclient->governor;
+    sbuf sb;
+    sb.printf("\r\n\033[7m[domterm: output %s - %ld bytes discarded]\033[m\r\n",
+              what, gov->discarded);
+    pclient_write_output(pclient, sb.buffer, sb.len);
+}
+
+static void
+governor_collapse(struct pty_client *pclient)
+{
+    struct output_governor *gov = pclient->governor;
+    lwsl_notice("session %d output collapsed (over %g bytes/second)\n",
+                pclient->session_number, governor_rate);
+    pclient->output_collapsed = true;
+    gov->discarded = 0;
+    gov->tail.len = 0;
+    sbuf sb;
+    sb.printf("\r\n\033[7m[domterm: output too fast (over %g bytes/second)"
+              " - collapsing]\033[m\r\n", governor_rate);
+    pclient_write_output(pclient, sb.buffer, sb.len);
+    wheel_timer_arm(&gov->timer, GOVERNOR_WINDOW_US);
+}
+
+static void
+governor_resume(struct pty_client *pclient)
+{
+    struct output_governor *gov = pclient->governor;
+    lwsl_notice("session %d output resumed (%ld bytes discarded)\n",
+                pclient->session_number, gov->discarded);
+    governor_summary(pclient, "resumed");
+    // Start the tail at a line boundary, if possible.
+    const char *start = gov->tail.buffer;
+    const char *end = start + gov->tail.len;
+    const char *nl = (const char *) memchr(start, '\n', gov->tail.len);
+    if (nl && nl + 1 < end && gov->discarded > (long) gov->tail.len)
+        start = nl + 1;
+    pclient_write_output(pclient, start, end - start);
+    pclient->output_collapsed = false;
+    gov->tail.reset();
+    gov->strikes = 0;
+}
+
+// Start a new measurement window if the current one is over.
+static void
+governor_check_window(struct pty_client *pclient, long now)
+{
+    struct output_governor *gov = pclient->governor;
+    long elapsed = now - gov->window_start_us;
+    if (elapsed < GOVERNOR_WINDOW_US)
+        return;
+    double rate = (double) gov->window_bytes * 1000000.0 / elapsed;
+    gov->window_start_us = now;
+    gov->window_bytes = 0;
+    if (rate > governor_rate)
+        gov->strikes++;
+    else
+        gov->strikes = 0;
+    if (pclient->output_collapsed) {
+        if (gov->strikes == 0)
+            governor_resume(pclient);
+        else
+            governor_summary(pclient, "collapsed");
+    } else if (gov->strikes >= governor_delay)
+        governor_collapse(pclient);
+}
+
+/* While collapsed, check the rate even if output has stopped. */
+static void
+governor_timer(struct wheel_timer *timer)
+{
+    struct pty_client *pclient = (struct pty_client *) timer->data;
+    if (! pclient->output_collapsed)
+        return;
+    governor_check_window(pclient, monotonic_usec());
+    if (pclient->output_collapsed)
+        wheel_timer_arm(timer, GOVERNOR_WINDOW_US);
+}
+
+/** Account for n bytes of output read from pclient's pty. */
+void
+governor_count(struct pty_client *pclient, long n)
+{
+    if (governor_rate <= 0 || pclient->is_ssh_pclient || n <= 0)
+        return;
+    struct output_governor *gov = pclient->governor;
+    long now = monotonic_usec();
+    if (gov == NULL) {
+        gov = new output_governor();
+        gov->window_start_us = now;
+        gov->window_bytes = 0;
+        gov->strikes = 0;
+        gov->discarded = 0;
+        gov->timer.callback = governor_timer;
+        gov->timer.data = pclient;
+        pclient->governor = gov;
+    }
+    gov->window_bytes += n;
+    governor_check_window(pclient, now);
+}
+
+/** Read and discard output from a collapsed session.
+ * Returns -1 on end-of-file, like callback_pty. */
+int
+governor_discard(struct pty_client *pclient, int fd_in)
+{
+    struct output_governor *gov = pclient->governor;
+    char buf[65536];
+    ssize_t n = read(fd_in, buf, sizeof(buf));
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+        return -1;
+    if (n < 0)
+        return 0;
+    char *data = buf;
+#if USE_PTY_PACKET_MODE
+    if (pclient->uses_packet_mode) {
+        // A control packet has no data; handle it as handle_process_output
+        // does, so the frontend still hears about termios changes.
+        if (buf[0] != TIOCPKT_DATA) {
+#if TIOCPKT_IOCTL
+            if (n == 1 && (buf[0] & TIOCPKT_IOCTL) != 0)
+                pclient_report_termios(pclient, fd_in);
+#endif
+            return 0;
+        }
+        data++;
+        n--;
+    }
+#endif
+    gov->discarded += n;
+    gov->window_bytes += n;
+    if (governor_tail > 0) {
+        gov->tail.append(data, n);
+        if ((long) gov->tail.len > 2 * governor_tail)
+            gov->tail.erase(0, gov->tail.len - governor_tail);
+    }
+    trace_bytes(n);
+    if (pclient->output_scanner && n > 0)
+        scan_process_output(pclient, data, n);
+    if (pclient->output_taps && n > 0)
+        tap_process_output(pclient, data, n);
+    governor_check_window(pclient, monotonic_usec());
+    return 0;
+}
+
+void
+governor_close(struct pty_client *pclient)
+{
+    pclient->output_collapsed = false;
+    if (pclient->governor)
+        wheel_timer_cancel(&pclient->governor->timer);
+    delete pclient->governor;
+    pclient->governor = NULL;
+}
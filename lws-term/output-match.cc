@@ -0,0 +1,349 @@
+/* Server-side matching of session output, for 'domterm await -s'.
+ *
+ * The output of a session is scanned as it is read from the pty
+ * (in handle_process_output), so this works whether or not a
+ * front-end is rendering the session.
+ * Escape sequences are removed by a small state machine that keeps
+ * its state across reads, so neither sequences nor lines need to be
+ * complete within a single chunk.  We keep only the last few lines of
+ * (plain) text, which is what the --match-output rules look at;
+ * the rules are only re-run when a chunk changes that text.
+ */
+
+#include "server.h"
+#include <regex>
+#include <vector>
+
+/* Upper bound on the text kept for matching (in case of very long lines).
+ * The text comes from the session's program, and libstdc++'s
+ * std::regex_search recurses per character (so a long input can
+ * overflow the stack - GCC bug 86164), so keep this small.
+ * A longer line is matched using only its last SCAN_TEXT_MAX bytes. */
+#define SCAN_TEXT_MAX 4096
+
+enum scan_state {
+    SCAN_TEXT = 0,
+    SCAN_ESC, // seen ESC
+    SCAN_ESC_INTERMEDIATE, // seen ESC and one or more intermediate bytes
+    SCAN_CSI, // in a control sequence: ESC [ ...
+    SCAN_STRING, // in a string (OSC, DCS, APC, PM, SOS)
+    SCAN_STRING_ESC // in a string, seen ESC (maybe start of ST)
+};
+
+struct output_rule {
+    std::regex pattern;
+    std::string response;
+    int nlines;
+};
+
+/* A pending 'await -s' request.
+ * The lws user data of the "await" protocol points to one of these. */
+struct output_await {
+    struct options *options;
+    struct pty_client *pclient; // NULL when no longer pending
+    struct lws *wsi;
+    std::vector<output_rule> rules;
+    bool await_close;
+    std::string close_response;
+    std::string timeout_message;
+};
+
+/* Per-session scanner state, shared by all pending requests
+ * for that session.  Only allocated while there is a request. */
+struct output_scanner {
+    enum scan_state state = SCAN_TEXT;
+    bool cr_pending = false; // seen '\r' - new text replaces current line
+    int max_lines = 1; // maximum of nlines of the rules
+    std::string text; // recent lines of output, without escape sequences
+    std::vector<struct output_await *> awaits;
+};
+
+static void
+scanner_remove(struct pty_client *pclient, struct output_await *aw)
+{
+    struct output_scanner *scanner = pclient->output_scanner;
+    if (scanner == nullptr)
+        return;
+    for (auto it = scanner->awaits.begin(); it != scanner->awaits.end(); it++) {
+        if (*it == aw) {
+            scanner->awaits.erase(it);
+            break;
+        }
+    }
+    if (scanner->awaits.empty()) {
+        delete scanner;
+        pclient->output_scanner = nullptr;
+    }
+}
+
+static void
+await_finish(struct output_await *aw, int exit_code,
+             const std::string *out, const char *err)
+{
+    struct options *opts = aw->options;
+    if (aw->pclient) {
+        scanner_remove(aw->pclient, aw);
+        aw->pclient = nullptr;
+    }
+    if (out && ! out->empty()) {
+        std::string response = *out;
+        if (response.back() != '\n')
+            response += '\n';
+        write(opts->fd_out, response.c_str(), response.length());
+    }
+    if (err && err[0])
+        printf_error(opts, "%s", err);
+    finish_request(opts, exit_code, false);
+    // Socket is closed (by lws) in callback_await.
+    lws_set_timer_usecs(aw->wsi, LWS_SET_TIMER_USEC_CANCEL);
+    lws_set_timeout(aw->wsi, PENDING_TIMEOUT_SHUTDOWN_FLUSH, LWS_TO_KILL_ASYNC);
+}
+
+// Start of last nlines lines of text, ignoring trailing empty lines.
+static size_t
+tail_start(const std::string& text, int nlines, size_t *endp)
+{
+    size_t end = text.length();
+    while (end > 0 && text[end-1] == '\n')
+        end--;
+    size_t start = end;
+    for (; start > 0; start--) {
+        if (text[start-1] == '\n' && --nlines == 0)
+            break;
+    }
+    *endp = end;
+    return start;
+}
+
+// Returns true if the kept text changed.
+static bool
+scan_bytes(struct output_scanner *scanner, const char *data, size_t length)
+{
+    std::string& text = scanner->text;
+    enum scan_state state = scanner->state;
+    bool changed = false;
+    for (size_t i = 0; i < length; i++) {
+        unsigned char ch = data[i];
+        switch (state) {
+        case SCAN_TEXT:
+            if (ch == '\033')
+                state = SCAN_ESC;
+            else if (ch == '\n') {
+                text += '\n';
+                scanner->cr_pending = false;
+                changed = true;
+            } else if (ch == '\r')
+                scanner->cr_pending = true;
+            else if (ch == '\b') {
+                // Remove last character (but not a line break).
+                size_t len = text.length();
+                while (len > 0 && (text[len-1] & 0xC0) == 0x80)
+                    len--;
+                if (len > 0 && text[len-1] != '\n') {
+                    text.erase(len-1);
+                    changed = true;
+                }
+            } else if ((ch >= ' ' && ch != 0x7F) || ch == '\t') {
+                if (scanner->cr_pending) {
+                    size_t nl = text.rfind('\n');
+                    text.erase(nl == std::string::npos ? 0 : nl + 1);
+                    scanner->cr_pending = false;
+                }
+                text += (char) ch;
+                changed = true;
+            }
+            break;
+        case SCAN_ESC:
+            if (ch == '[')
+                state = SCAN_CSI;
+            else if (ch == ']' || ch == 'P' || ch == '_'
+                     || ch == '^' || ch == 'X')
+                state = SCAN_STRING;
+            else if (ch >= 0x20 && ch <= 0x2F)
+                state = SCAN_ESC_INTERMEDIATE;
+            else
+                state = ch == '\033' ? SCAN_ESC : SCAN_TEXT;
+            break;
+        case SCAN_ESC_INTERMEDIATE:
+            if (ch < 0x20 || ch > 0x2F)
+                state = SCAN_TEXT;
+            break;
+        case SCAN_CSI:
+            if (ch == '\033')
+                state = SCAN_ESC;
+            else if (ch >= 0x40 && ch <= 0x7E)
+                state = SCAN_TEXT;
+            break;
+        case SCAN_STRING:
+            if (ch == '\007')
+                state = SCAN_TEXT;
+            else if (ch == '\033')
+                state = SCAN_STRING_ESC;
+            break;
+        case SCAN_STRING_ESC:
+            if (ch == '\\')
+                state = SCAN_TEXT;
+            else if (ch != '\033')
+                state = SCAN_STRING;
+            break;
+        }
+    }
+    scanner->state = state;
+
+    // Only keep what the rules can look at.
+    size_t end;
+    size_t start = tail_start(text, scanner->max_lines, &end);
+    if (end - start > SCAN_TEXT_MAX)
+        start = end - SCAN_TEXT_MAX;
+    if (start > 0)
+        text.erase(0, start);
+    return changed;
+}
+
+/** Called with output read from the pty of a session that has
+ * a pending 'await -s' request. */
+void
+scan_process_output(struct pty_client *pclient, const char *data, size_t length)
+{
+    struct output_scanner *scanner = pclient->output_scanner;
+    if (length == 0 || ! scan_bytes(scanner, data, length))
+        return;
+
+    std::vector<std::pair<struct output_await *, const std::string *>> matched;
+    for (struct output_await *aw : scanner->awaits) {
+        for (const output_rule& rule : aw->rules) {
+            size_t end;
+            size_t start = tail_start(scanner->text, rule.nlines, &end);
+            auto tbegin = scanner->text.cbegin();
+            if (std::regex_search(tbegin + start, tbegin + end, rule.pattern)) {
+                matched.push_back(std::make_pair(aw, &rule.response));
+                break;
+            }
+        }
+    }
+    // await_finish may delete the scanner, so don't do it while iterating.
+    for (auto& m : matched) {
+        lwsl_info("await -s matched output of session %d\n",
+                  pclient->session_number);
+        await_finish(m.first, EXIT_SUCCESS, m.second, nullptr);
+    }
+}
+
+/** Called when session exits, to resolve pending 'await -s' requests. */
+void
+output_scanner_close(struct pty_client *pclient)
+{
+    while (pclient->output_scanner != nullptr) {
+        struct output_await *aw = pclient->output_scanner->awaits.front();
+        if (aw->await_close)
+            await_finish(aw, EXIT_SUCCESS, &aw->close_response, nullptr);
+        else {
+            char msg[80];
+            snprintf(msg, sizeof(msg),
+                     "Session %d exited before output matched.",
+                     pclient->session_number);
+            await_finish(aw, EXIT_FAILURE, nullptr, msg);
+        }
+    }
+}
+
+int
+callback_await(struct lws *wsi, enum lws_callback_reasons reason,
+               void *user, void *in, size_t len)
+{
+    struct output_await **awp = (struct output_await **) user;
+    struct output_await *aw = awp ? *awp : nullptr;
+    if (aw == nullptr)
+        return 0;
+    switch (reason) {
+    case LWS_CALLBACK_RAW_RX_FILE: {
+        // Ignore (forwarded stdin), but notice when client goes away.
+        char buf[512];
+        ssize_t n = read(aw->options->fd_cmd_socket, buf, sizeof(buf));
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+            return -1;
+        break;
+    }
+    case LWS_CALLBACK_TIMER:
+        if (aw->pclient)
+            await_finish(aw, EXIT_FAILURE, nullptr,
+                         aw->timeout_message.c_str());
+        break;
+    case LWS_CALLBACK_RAW_CLOSE_FILE: {
+        if (aw->pclient)
+            scanner_remove(aw->pclient, aw);
+        struct options *opts = aw->options;
+        opts->fd_cmd_socket = -1; // closed by lws
+        options::release(opts);
+        delete aw;
+        *awp = nullptr;
+        break;
+    }
+    default:
+        break;
+    }
+    return 0;
+}
+
+/** Handle 'domterm await -s SESSION ...'.
+ * The matches array has the --match-output rules in the same format
+ * we would send to the front-end.  A negative timeout means none.
+ */
+int
+await_output_action(struct pty_client *pclient, const json& matches,
+                    double timeout, const char *timeout_message,
+                    const char *close_response, struct options *opts)
+{
+    struct output_await *aw = new output_await();
+    aw->options = opts;
+    aw->pclient = pclient;
+    aw->await_close = close_response != nullptr;
+    if (close_response)
+        aw->close_response = close_response;
+    if (timeout_message)
+        aw->timeout_message = timeout_message;
+    int max_lines = 1;
+    for (const json& match_spec : matches) {
+        output_rule rule;
+        std::string pattern = match_spec["match"];
+        try {
+            rule.pattern = std::regex(pattern);
+        } catch (const std::regex_error& ex) {
+            printf_error(opts, "bad --match-output pattern '%s': %s",
+                         pattern.c_str(), ex.what());
+            delete aw;
+            return EXIT_BAD_CMDARG;
+        }
+        rule.response = match_spec["out"];
+        rule.nlines = match_spec.contains("nlines")
+            ? match_spec["nlines"].get<int>() : 1;
+        if (rule.nlines > max_lines)
+            max_lines = rule.nlines;
+        aw->rules.push_back(std::move(rule));
+    }
+
+    lws_sock_file_fd_type fd;
+    fd.filefd = opts->fd_cmd_socket;
+    struct lws *awsi = lws_adopt_descriptor_vhost(vhost, LWS_ADOPT_RAW_FILE_DESC,
+                                                  fd, "await", NULL);
+    if (awsi == NULL) {
+        printf_error(opts, "domterm await: failed to register request");
+        delete aw;
+        return EXIT_FAILURE;
+    }
+    aw->wsi = awsi;
+    *(struct output_await **) lws_wsi_user(awsi) = aw;
+
+    struct output_scanner *scanner = pclient->output_scanner;
+    if (scanner == nullptr) {
+        scanner = new output_scanner();
+        pclient->output_scanner = scanner;
+    }
+    if (max_lines > scanner->max_lines)
+        scanner->max_lines = max_lines;
+    scanner->awaits.push_back(aw);
+    pclient_resume_detached(pclient);
+    if (timeout > 0)
+        lws_set_timer_usecs(awsi, (lws_usec_t) (timeout * LWS_USEC_PER_SEC));
+    return EXIT_WAIT;
+}
@@ -0,0 +1,263 @@
+/* Raw output taps, for 'domterm tail'.
+ *
+ * A tap copies the raw output of a session (as read from the pty)
+ * to a command client.  Each tap has its own bounded queue:
+ * a slow reader never pauses the session (as a slow window would);
+ * instead output that doesn't fit is dropped (and reported).
+ * A session with a tap is read even when it has no windows.
+ */
+
+#include "server.h"
+
+// Maximum bytes queued for a tap before we start dropping output.
+#define TAP_QUEUE_MAX (1024 * 1024)
+
+// Default number of lines of preserved output to start with.
+#define TAP_DEFAULT_LINES 10
+
+/* The lws user data of the "tail" protocol points to one of these. */
+struct output_tap {
+    struct options *options;
+    struct pty_client *pclient; // NULL after session exits
+    struct output_tap *next; // in list headed by pclient->output_taps
+    struct lws *wsi;
+    rbuf queue;
+    size_t dropped; // bytes discarded since last report
+    bool follow;
+    bool finished;
+};
+
+static void
+tap_unlink(struct output_tap *tap)
+{
+    struct pty_client *pclient = tap->pclient;
+    if (pclient == nullptr)
+        return;
+    for (struct output_tap **p = &pclient->output_taps; *p; p = &(*p)->next) {
+        if (*p == tap) {
+            *p = tap->next;
+            break;
+        }
+    }
+    tap->pclient = nullptr;
+    tap->next = nullptr;
+}
+
+// Append data, quoting any bytes the client would take as control codes.
+static void
+tap_append(struct output_tap *tap, const char *data, size_t length)
+{
+    tap->queue.reserve(length);
+#if PASS_STDFILES_UNIX_SOCKET
+    tap->queue.append(data, length);
+#else
+    size_t start = 0;
+    for (size_t i = 0; i < length; i++) {
+        unsigned char ch = data[i];
+        if (ch <= PASS_STDFILES_SWITCH_TO_STDERR) {
+            tap->queue.append(data + start, i - start);
+            char quote = PASS_STDFILES_QUOTE;
+            tap->queue.append(&quote, 1);
+            start = i; // quoted byte is copied with the next segment
+        }
+    }
+    tap->queue.append(data + start, length - start);
+#endif
+}
+
+/** Called with output read from the pty of a session that has taps. */
+void
+tap_process_output(struct pty_client *pclient, const char *data, size_t length)
+{
+    for (struct output_tap *tap = pclient->output_taps; tap != nullptr;
+         tap = tap->next) {
+        if (tap->queue.data_length() + length > TAP_QUEUE_MAX)
+            tap->dropped += length;
+        else
+            tap_append(tap, data, length);
+        lws_callback_on_writable(tap->wsi);
+    }
+}
+
+/** Called when a session exits.  Taps finish after writing queued data. */
+void
+output_taps_close(struct pty_client *pclient)
+{
+    struct output_tap *tap;
+    while ((tap = pclient->output_taps) != nullptr) {
+        tap_unlink(tap);
+        lws_callback_on_writable(tap->wsi);
+    }
+}
+
+static void
+tap_report_dropped(struct output_tap *tap)
+{
+#if PASS_STDFILES_UNIX_SOCKET
+    dprintf(tap->options->fd_err, "domterm tail: %zu bytes dropped\n",
+            tap->dropped);
+#else
+    tap->queue.printf("%cdomterm tail: %zu bytes dropped\n%c",
+                      PASS_STDFILES_SWITCH_TO_STDERR, tap->dropped,
+                      PASS_STDFILES_SWITCH_TO_STDOUT);
+#endif
+    tap->dropped = 0;
+}
+
+int
+callback_tail(struct lws *wsi, enum lws_callback_reasons reason,
+              void *user, void *in, size_t len)
+{
+    struct output_tap **tapp = (struct output_tap **) user;
+    struct output_tap *tap = tapp ? *tapp : nullptr;
+    if (tap == nullptr)
+        return 0;
+    switch (reason) {
+    case LWS_CALLBACK_RAW_RX_FILE: {
+        // Ignore (forwarded stdin), but notice when client goes away.
+        char buf[512];
+        ssize_t n = read(tap->options->fd_cmd_socket, buf, sizeof(buf));
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+            return -1;
+        break;
+    }
+    case LWS_CALLBACK_RAW_WRITEABLE_FILE: {
+        if (tap->finished)
+            break;
+        if (tap->queue.data_length() == 0 && tap->dropped > 0)
+            tap_report_dropped(tap);
+        if (tap->queue.data_length() > 0) {
+            ssize_t n = write(tap->options->fd_out,
+                              tap->queue.data(), tap->queue.data_length());
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EINTR) {
+                    lws_callback_on_writable(wsi);
+                    break;
+                }
+                lwsl_notice("domterm tail write failed: %s\n", strerror(errno));
+                return -1;
+            }
+            tap->queue.consume(n);
+            if (tap->queue.data_length() > 0 || tap->dropped > 0) {
+                lws_callback_on_writable(wsi);
+                break;
+            }
+        }
+        if (tap->pclient == nullptr || ! tap->follow) {
+            tap->finished = true;
+            tap_unlink(tap);
+            finish_request(tap->options, EXIT_SUCCESS, false);
+            lws_set_timeout(wsi, PENDING_TIMEOUT_SHUTDOWN_FLUSH,
+                            LWS_TO_KILL_ASYNC);
+        }
+        break;
+    }
+    case LWS_CALLBACK_RAW_CLOSE_FILE: {
+        tap_unlink(tap);
+        struct options *opts = tap->options;
+        opts->fd_cmd_socket = -1; // closed by lws
+        options::release(opts);
+        delete tap;
+        *tapp = nullptr;
+        break;
+    }
+    default:
+        break;
+    }
+    return 0;
+}
+
+int tail_action(int argc, arglist_t argv, struct options *opts)
+{
+    const char *session_specifier = nullptr;
+    bool follow = false, from_start = false;
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (strcmp(arg, "-f") == 0 || strcmp(arg, "--follow") == 0)
+            follow = true;
+        else if (strcmp(arg, "--from-start") == 0)
+            from_start = true;
+        else if (strncmp(arg, "-s", 2) == 0) {
+            if (strlen(arg) > 2) {
+                session_specifier = arg + 2;
+            } else if (i+1 < argc) {
+                session_specifier = argv[++i];
+            } else {
+                printf_error(opts, "missing argument following -s");
+                return EXIT_BAD_CMDARG;
+            }
+        } else {
+            printf_error(opts, "domterm tail: unrecognized option '%s'", arg);
+            return EXIT_BAD_CMDARG;
+        }
+    }
+    struct pty_client *pclient;
+    if (session_specifier) {
+        if (! opts->windows.empty()) {
+            printf_error(opts, "domterm tail: both -w (window) and -s (session) options");
+            return EXIT_BAD_CMDARG;
+        }
+        pclient = find_session(session_specifier);
+        if (pclient == NULL) {
+            printf_error(opts, "domterm tail: no session '%s' found",
+                         session_specifier);
+            return EXIT_FAILURE;
+        }
+    } else {
+        std::string woption = opts->windows;
+        if (woption.empty())
+            woption = ".";
+        int window = check_single_window_option(woption, "tail", opts);
+        if (window < 0)
+            return EXIT_FAILURE;
+        pclient = tty_clients(window)->pclient;
+        if (pclient == NULL) {
+            printf_error(opts, "domterm tail: no session for window '%s'",
+                         woption.c_str());
+            return EXIT_FAILURE;
+        }
+    }
+
+    lws_sock_file_fd_type fd;
+    fd.filefd = opts->fd_cmd_socket;
+    struct lws *twsi = lws_adopt_descriptor_vhost(vhost, LWS_ADOPT_RAW_FILE_DESC,
+                                                  fd, "tail", NULL);
+    if (twsi == NULL) {
+        printf_error(opts, "domterm tail: failed to register request");
+        return EXIT_FAILURE;
+    }
+    if (opts->fd_out == opts->fd_cmd_socket)
+        setblocking(opts->fd_out, 0);
+    struct output_tap *tap = new output_tap();
+    tap->options = opts;
+    tap->wsi = twsi;
+    tap->follow = follow;
+    tap->dropped = 0;
+    tap->finished = false;
+    *(struct output_tap **) lws_wsi_user(twsi) = tap;
+
+    // Start with (the end of) what the server still has of the output.
+    memory_restore_preserved(pclient);
+    if (pclient->preserved_output) {
+        const char *start = pclient->preserved_output + pclient->preserved_start;
+        const char *end = pclient->preserved_output + pclient->preserved_end;
+        const char *p = end;
+        if (! from_start) {
+            int nlines = TAP_DEFAULT_LINES + (p > start && p[-1] == '\n');
+            for (; p > start; p--) {
+                if (p[-1] == '\n' && --nlines == 0)
+                    break;
+            }
+        } else
+            p = start;
+        tap_append(tap, p, end - p);
+    }
+    if (follow) {
+        tap->pclient = pclient;
+        tap->next = pclient->output_taps;
+        pclient->output_taps = tap;
+        pclient_resume_detached(pclient);
+    }
+    lws_callback_on_writable(twsi);
+    return EXIT_WAIT;
+}
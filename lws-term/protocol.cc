@@ -14,6 +14,9 @@
 // Maximum number of unconfirmed bytes to continue after pausing
 // Must be at least as much as "flow-confirm-every" setting.
 #define MAX_CONTINUE 4000
+// Pause a session if this much of its output is waiting to be written
+// to a proxy (see proxy_write).
+#define MAX_PROXY_PENDING 65536
 
 #if defined(TIOCPKT)
 // See https://stackoverflow.com/questions/21641754/when-pty-pseudo-terminal-slave-fd-settings-are-changed-by-tcsetattr-how-ca
@@ -24,7 +27,11 @@ extern char **environ;
 
 static char eof_message[] = OUT_OF_BAND_START_STRING "\033[99;99u" URGENT_END_STRING;
 #define eof_len (sizeof(eof_message)-1)
+#define SNAPSHOT_COMPRESS_MIN 16384 /* compress saved windows at least this big */
+
 static char request_contents_message[] = URGENT_WRAP("\033[81u");
+// Like request_contents_message, but don't send a WINDOW-CONTENTS-DELTA.
+static char request_full_contents_message[] = URGENT_WRAP("\033[81;1u");
 
 static char start_replay_mode[] = "\033[97u";
 static char end_replay_mode[] = "\033[98u";
@@ -33,6 +40,12 @@ id_table<pty_client> pty_clients;
 id_table<tty_client> tty_clients;
 id_table<browser_cmd_client> browser_cmd_clients;
 main_id_table main_windows;
+name_index<pty_client> sessions_by_name;
+// Sessions started ahead of time for shell.prewarm; see prewarm_fill.
+static std::vector<struct pty_client *> prewarm_pool;
+static void prewarm_exited();
+name_index<tty_client> windows_by_name;
+id_table<struct watch_client> watchers; // 'domterm watch' subscribers
 
 int current_dragover_window = -1;
 int drag_start_window = -1;
@@ -82,7 +95,9 @@ check_host_origin(struct lws *wsi) {
 // Maybe remove unneeded preserved output
 void trim_preserved(struct pty_client *pclient)
 {
-    if (pclient->preserve_mode == 2 && pclient->saved_window_contents == NULL)
+    memory_restore_preserved(pclient);
+    bool have_window = pclient_has_saved_window(pclient);
+    if (pclient->preserve_mode == 2 && ! have_window)
         return;
 
     size_t old_length = pclient->preserved_end - pclient->preserved_start;
@@ -93,7 +108,7 @@ void trim_preserved(struct pty_client *pclient)
          if (unconfirmed > max_unconfirmed)
              max_unconfirmed = unconfirmed;
      };
-     if (pclient->saved_window_contents) {
+     if (have_window) {
          size_t unconfirmed =
              (read_count - pclient->saved_window_sent_count) & MASK28;
          if (unconfirmed > max_unconfirmed)
@@ -213,6 +228,7 @@ pclient_close(struct pty_client *pclient, bool xxtimed_out)
         free(pclient->ttyname);
         pclient->ttyname = NULL;
     }
+    memory_release(pclient);
     if (pclient->saved_window_contents != NULL) {
         free(pclient->saved_window_contents);
         pclient->saved_window_contents = NULL;
@@ -283,7 +299,24 @@ pclient_close(struct pty_client *pclient, bool xxtimed_out)
     if (WEXITSTATUS(status) == 0xFF && connection_failure) {
         lwsl_notice("DISCONNECTED\n");
     }
+    watch_notify("session-exited", pclient, NULL, status);
+    sessions_by_name.remove(pclient->session_name, pclient);
+    output_scanner_close(pclient);
+    output_taps_close(pclient);
+    governor_close(pclient);
+    proxy_inflate_close(pclient);
+    wheel_timer_cancel(&pclient->remote_timer);
     pty_clients.remove(pclient);
+    if (pclient->prewarmed) {
+        for (auto it = prewarm_pool.begin(); it != prewarm_pool.end(); it++) {
+            if (*it == pclient) {
+                prewarm_pool.erase(it);
+                break;
+            }
+        }
+        prewarm_exited();
+        return;
+    }
 
 // remove from sessions list
     tserver.session_count--;
@@ -347,6 +380,7 @@ unlink_tty_from_pty(struct pty_client *pclient, struct tty_client *tclient)
 {
     lwsl_notice("unlink_tty_from_pty p:%p t:%p\n", pclient, tclient);
     tclient->unlink_pclient();
+    watch_notify("window-detached", pclient, tclient);
 
     if (tclient->is_primary_window) {
         tclient->is_primary_window = false;
@@ -405,9 +439,13 @@ tty_client::~tty_client()
     struct pty_client *pclient = tclient->pclient;
     int wnumber = tclient->connection_number;
     if (! keep_client) {
+        windows_by_name.remove(tclient->window_name, tclient);
         clear_connection_number(tclient);
         free(tclient->ssh_connection_info);
         tclient->ssh_connection_info = NULL;
+        proxy_deflate_close(tclient);
+        wheel_timer_cancel(&tclient->keepalive_timer);
+        wheel_timer_cancel(&tclient->input_timer);
         if (pclient != NULL)
             unlink_tty_from_pty(pclient, tclient);
     }
@@ -447,18 +485,16 @@ tty_client::set_window_name(const std::string& name)
     bool old_unique = this->window_name_unique;
     bool unique = true;
     bool same_name = window_name == name;
-    struct tty_client *oclient;
-    FORALL_WSCLIENT(oclient) {
-        if (oclient != this && oclient->window_name == name) {
-            unique = false;
-        }
-    }
+    if (windows_by_name.count(name) > (same_name ? 1 : 0))
+        unique = false;
     if (same_name && unique == old_unique)
         return;
     std::string old_name = this->window_name;
     this->window_name_unique = unique;
     if (! same_name) {
+        windows_by_name.remove(old_name, this);
         this->window_name = name;
+        windows_by_name.enter(name, this);
         if (pclient) {
             std::string sname;
             FOREACH_WSCLIENT(w, pclient) {
@@ -471,15 +507,23 @@ tty_client::set_window_name(const std::string& name)
                     sname = other_name;
                 }
             }
-            pclient->session_name = sname;
+            pclient->set_session_name(sname);
         }
+        watch_notify("name-changed", pclient, this);
     }
 
     if (! unique || ! old_unique) {
-        FORALL_WSCLIENT(oclient) {
-            if (oclient != this
-                && (oclient->window_name == old_name
-                    || oclient->window_name == name)) {
+        std::vector<struct tty_client *> others;
+        auto range = windows_by_name.find(old_name);
+        for (auto it = range.first; it != range.second; it++)
+            others.push_back(it->second);
+        if (! same_name) {
+            range = windows_by_name.find(name);
+            for (auto it = range.first; it != range.second; it++)
+                others.push_back(it->second);
+        }
+        for (struct tty_client *oclient : others) {
+            if (oclient != this) {
                 std::string oname = oclient->window_name;
                 // update oclient->window_name_unique.
                 oclient->set_window_name(oname);
@@ -561,6 +605,7 @@ void link_command(struct lws *wsi, struct tty_client *tclient,
     }
     lwsl_notice("link_command wsi:%p tclient:%p pclient:%p\n",
                 wsi, tclient, pclient);
+    watch_notify("window-attached", pclient, tclient);
     tclient->pty_window_update_needed = true;
     if (tclient->proxyMode != proxy_command_local
         && tclient->proxyMode != proxy_display_local)
@@ -575,6 +620,7 @@ void link_command(struct lws *wsi, struct tty_client *tclient,
                             1|LWS_RXFLOW_REASON_FLAG_PROCESS_NOW);
 #endif
         pclient->paused = 0;
+        watch_notify("unpaused", pclient, tclient);
     }
 }
 
@@ -596,56 +642,19 @@ void put_to_env_array(const char **arr, int max, const char* eval)
     }
 }
 
-template<typename T>
-bool id_table<T>::avoid_index(int i, int hint) {
-    return valid_index(i) ||
-        (i != hint && (tty_clients.valid_index(i) ||
-                       main_windows.valid_index(i) ||
-                       pty_clients.valid_index(i)));
-}
-
-template<typename T>
-int id_table<T>::enter(T *entry, int hint)
-{
-    int snum = 1;
-    if (hint > 0 && ! valid_index(hint))
-        snum = hint;
-    for (; ; snum++) {
-        if (snum >= sz) {
-            int newsize = 3 * sz >> 1;
-            if (newsize < 20)
-                newsize = 20;
-            elements = (T**) realloc(elements, newsize * sizeof(T*));
-            for (int i = sz; i < newsize; i++)
-                elements[i] = nullptr;
-            sz = newsize;
-        }
-        T*next = elements[snum];
-        if (next == NULL || next->index() > snum) {
-            if ((hint < 0 || snum != hint) && avoid_index(snum, hint))
-                continue;
-            // Maintain invariant
-            for (int iprev = snum;
-                 --iprev >= 0 && elements[iprev] == next; ) {
-                elements[iprev] = entry;
-            }
-            elements[snum] = entry;
-            //pclient->session_number = snum;
-            return snum;
-        }
-    }
+// Indexes of windows and sessions share one space (see id_table).
+bool
+id_tables_valid_index(int i)
+{
+    return tty_clients.valid_index(i) || main_windows.valid_index(i)
+        || pty_clients.valid_index(i);
 }
-template<typename T>
-void id_table<T>::remove(T* entry)
+
+uint64_t
+id_tables_used_word(size_t w)
 {
-    if (entry == nullptr)
-        return;
-    int index = entry->index();
-    if (! valid_index(index))
-        return;
-    T* next = elements[index+1];
-    for (; index >= 0 && elements[index] == entry; index--)
-            elements[index] = next;
+    return tty_clients.used_word(w) | main_windows.used_word(w)
+        | pty_clients.used_word(w);
 }
 
 main_id_table::~main_id_table()
@@ -680,10 +689,182 @@ request_enter(struct options *opts, tty_client* tclient)
     tclient->pending_requests.enter(opts, opts->index());
 }
 
+int
+watch_client::index()
+{
+    return options->fd_cmd_socket;
+}
+
+// Maximum bytes of event lines queued for a 'domterm watch' subscriber.
+#define WATCH_QUEUE_MAX 65536
+
+/* Report a session/window state change to each 'domterm watch' subscriber,
+ * as a single line of JSON.
+ * The exit_status is a waitpid status, or -1 if not applicable.
+ */
+void
+watch_notify(const char *event, struct pty_client *pclient,
+             struct tty_client *tclient, int exit_status)
+{
+    if (watchers.first() == nullptr || (pclient && pclient->prewarmed))
+        return;
+    json jevent;
+    jevent["event"] = event;
+    if (pclient) {
+        jevent["session"] = pclient->session_number;
+        if (pclient->pid > 0)
+            jevent["pid"] = pclient->pid;
+        if (! pclient->session_name.empty())
+            jevent["session-name"] = pclient->session_name;
+    }
+    if (tclient) {
+        if (tclient->connection_number >= 0)
+            jevent["window"] = tclient->connection_number;
+        if (! tclient->window_name.empty())
+            jevent["window-name"] = tclient->window_name;
+    }
+    if (exit_status != -1) {
+        if (WIFEXITED(exit_status))
+            jevent["exit-code"] = WEXITSTATUS(exit_status);
+        else if (WIFSIGNALED(exit_status))
+            jevent["signal"] = WTERMSIG(exit_status);
+    }
+    std::string line = jevent.dump();
+    line += '\n';
+    for (struct watch_client *watcher = watchers.first(); watcher != nullptr;
+         watcher = watchers.next(watcher)) {
+        // Only whole lines are queued, so a slow subscriber may miss
+        // events, but never sees a partial line.
+        rbuf *queue = watcher->queue;
+        if (queue->data_length() + line.length() > WATCH_QUEUE_MAX) {
+            watcher->dropped++;
+            continue;
+        }
+        queue->reserve(line.length());
+        queue->append(line.c_str(), line.length());
+        lws_callback_on_writable(watcher->wsi);
+    }
+}
+
+/** Handle the command socket of a 'domterm watch' subscriber.
+ * We don't expect input (except forwarded stdin, which we ignore),
+ * but we need to notice when the client goes away.
+ */
+int
+callback_watch(struct lws *wsi, enum lws_callback_reasons reason,
+               void *user, void *in, size_t len)
+{
+    struct watch_client *wclient = (struct watch_client *) user;
+    switch (reason) {
+    case LWS_CALLBACK_RAW_RX_FILE: {
+        char buf[512];
+        ssize_t n = read(wclient->options->fd_cmd_socket, buf, sizeof(buf));
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+            return -1;
+        break;
+    }
+    case LWS_CALLBACK_RAW_WRITEABLE_FILE: {
+        rbuf *queue = wclient->queue;
+        if (wclient->options == nullptr || queue->data_length() == 0)
+            break;
+        ssize_t n = write(wclient->options->fd_out,
+                          queue->data(), queue->data_length());
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EINTR)
+                return -1;
+            n = 0;
+        }
+        queue->consume(n);
+        if (queue->data_length() > 0)
+            lws_callback_on_writable(wsi);
+        else if (wclient->dropped > 0) {
+            lwsl_notice("%zu watch events dropped for socket %d\n",
+                        wclient->dropped, wclient->options->fd_cmd_socket);
+            wclient->dropped = 0;
+        }
+        break;
+    }
+    case LWS_CALLBACK_RAW_CLOSE_FILE: {
+        struct options *opts = wclient->options;
+        if (opts == nullptr)
+            break;
+        lwsl_notice("watch subscriber on socket %d closed\n",
+                    opts->fd_cmd_socket);
+        watchers.remove(wclient);
+        delete wclient->queue;
+        wclient->queue = nullptr;
+#if PASS_STDFILES_UNIX_SOCKET
+        if (opts->fd_err >= 0 && opts->fd_err != STDERR_FILENO)
+            close(opts->fd_err);
+        if (opts->fd_out >= 0 && opts->fd_out != STDOUT_FILENO)
+            close(opts->fd_out);
+        if (opts->fd_in >= 0 && opts->fd_in != STDIN_FILENO)
+            close(opts->fd_in);
+#endif
+        // The socket itself is closed by lws.
+        opts->fd_cmd_socket = -1;
+        wclient->options = nullptr;
+        options::release(opts);
+        break;
+    }
+    default:
+        break;
+    }
+    return 0;
+}
+
+int watch_action(int argc, arglist_t argv, struct options *opts)
+{
+    if (argc > 1) {
+        printf_error(opts, "unexpected argument '%s' to watch", argv[1]);
+        return EXIT_BAD_CMDARG;
+    }
+    int sockfd = opts->fd_cmd_socket;
+    if (sockfd < 0) {
+        printf_error(opts, "domterm watch requires a running server");
+        return EXIT_FAILURE;
+    }
+    lws_sock_file_fd_type fd;
+    fd.filefd = sockfd;
+    struct lws *wwsi = lws_adopt_descriptor_vhost(vhost, LWS_ADOPT_RAW_FILE_DESC,
+                                                  fd, "watch", NULL);
+    if (wwsi == NULL) {
+        printf_error(opts, "domterm watch failed to register subscriber");
+        return EXIT_FAILURE;
+    }
+    struct watch_client *wclient = (struct watch_client *) lws_wsi_user(wwsi);
+    // The subscription owns opts from now on; released in callback_watch.
+    wclient->options = opts;
+    wclient->wsi = wwsi;
+    wclient->queue = new rbuf();
+    wclient->dropped = 0;
+    // Never let a stalled subscriber block the server.
+    if (opts->fd_out == sockfd)
+        setblocking(sockfd, 0);
+    watchers.enter(wclient, wclient->index());
+    lwsl_notice("watch subscriber on socket %d\n", sockfd);
+    return EXIT_WAIT;
+}
+
+void
+pty_client::set_session_name(const std::string& name)
+{
+    if (name == session_name)
+        return;
+    sessions_by_name.remove(session_name, this);
+    session_name = name;
+    sessions_by_name.enter(name, this);
+}
+
 pty_client::pty_client()
 {
     use_xtermjs = false;
     use_ghostty = false;
+    prewarmed = false;
+    termios_cached = false;
+    output_collapsed = false;
+    history_evicted = false;
+    saved_window_is_base = false;
     pid = -1;
     nrows = -1;
     ncols = -1;
@@ -691,36 +872,49 @@ pty_client::pty_client()
     pixw = -1;
     detach_count = 0;
     paused = 0;
+    sched_deficit = 0;
+    sched_round = -1;
+    last_input_us = 0;
+    last_output_us = 0;
     saved_window_contents = NULL;
     preserved_output = NULL;
     preserve_mode = 1;
+    output_scanner = NULL;
+    output_taps = NULL;
+    governor = NULL;
+    compacted = NULL;
+    proxy_inflate = NULL;
 }
 
 static struct pty_client *
 create_pclient(const char *cmd, arglist_t argv, struct options *opts,
-               bool ssh_remoting, struct tty_client *t_hint)
+               bool ssh_remoting, struct tty_client *t_hint,
+               bool prewarm = false)
 {
     struct lws *outwsi;
     int master;
     int slave;
     bool packet_mode = false, use_xtermjs = false, use_ghostty = false;;
+    bool extproc = false;
+    struct termios tio;
 
     if (openpty(&master, &slave,NULL, NULL, NULL)) {
         lwsl_err("openpty\n");
         return NULL;
     }
 #if WITH_XTERMJS
-    std::string xtermjs_opt = get_setting_s(opts->settings, "xtermjs", "false");
-    int xtermjs_value = bool_value(xtermjs_opt.c_str());
+    const char *xtermjs_opt = opts->current_settings().xtermjs.get("false");
+    int xtermjs_value = bool_value(xtermjs_opt);
     if (xtermjs_value > 0 ||
         (xtermjs_value < 0
-         && (xtermjs_opt == "dom" || xtermjs_opt == "webgl"))) {
+         && (strcmp(xtermjs_opt, "dom") == 0
+             || strcmp(xtermjs_opt, "webgl") == 0))) {
         use_xtermjs = true;
     }
 #endif
 #if WITH_GHOSTTY
-    std::string ghostty_opt = get_setting_s(opts->settings, "ghostty", "false");
-    int ghostty_value = bool_value(ghostty_opt.c_str());
+    const char *ghostty_opt = opts->current_settings().ghostty.get("false");
+    int ghostty_value = bool_value(ghostty_opt);
     if (ghostty_value > 0) {
         use_ghostty = true;
     }
@@ -739,10 +933,9 @@ create_pclient(const char *cmd, arglist_t argv, struct options *opts,
     if (packet_mode
         && (opts->tty_packet_mode == NULL
             || strcmp(opts->tty_packet_mode, "extproc") == 0)) {
-        struct termios tio;
         tcgetattr(slave, &tio);
         tio.c_lflag |= EXTPROC;
-        tcsetattr(slave, TCSANOW, &tio);
+        extproc = tcsetattr(slave, TCSANOW, &tio) == 0;
     }
 #endif
 #endif
@@ -758,7 +951,15 @@ create_pclient(const char *cmd, arglist_t argv, struct options *opts,
     pclient->uses_packet_mode = packet_mode;
     pclient->use_xtermjs = use_xtermjs;
     pclient->use_ghostty = use_ghostty;
-    tserver.session_count++;
+    pclient->prewarmed = prewarm;
+#if TIOCPKT_IOCTL
+    if (extproc) {
+        pclient->cached_termios = tio;
+        pclient->termios_cached = true;
+    }
+#endif
+    if (! prewarm)
+        tserver.session_count++;
 
     int hint = t_hint ? t_hint->connection_number : -1;
     if (hint > 0 &&
@@ -786,6 +987,59 @@ create_pclient(const char *cmd, arglist_t argv, struct options *opts,
     return pclient;
 }
 
+/** Create a pty_client for an already-running session, whose pty master
+ * is fd, keeping its session number.  Used by upgrade_restore_sessions;
+ * the caller sets the remaining fields from the saved state. */
+struct pty_client *
+restore_pclient(int fd, int session_number)
+{
+    lws_sock_file_fd_type lfd;
+    lfd.filefd = fd;
+    struct lws *outwsi = lws_adopt_descriptor_vhost(vhost,
+                                                    LWS_ADOPT_RAW_FILE_DESC,
+                                                    lfd, "pty", NULL);
+    if (outwsi == NULL)
+        return NULL;
+    struct pty_client *pclient = new (lws_wsi_user(outwsi)) pty_client();
+    tserver.session_count++;
+    pclient->session_number = pty_clients.enter(pclient, session_number);
+    pclient->pty = fd;
+    pclient->pty_slave = -1;
+    pclient->stderr_client = NULL;
+    pclient->first_tclient = NULL;
+    pclient->last_tclient_ptr = &pclient->first_tclient;
+    pclient->recent_tclient = NULL;
+    pclient->timed_out = false;
+    pclient->is_ssh_pclient = false;
+    pclient->has_primary_window = false;
+    pclient->uses_packet_mode = false;
+    pclient->pty_wsi = outwsi;
+    pclient->ttyname = NULL;
+    pclient->cmd = NULL;
+    pclient->argv = NULL;
+#if REMOTE_SSH
+    pclient->cmd_socket = -1;
+    pclient->cur_pclient = NULL;
+#endif
+    return pclient;
+}
+
+// Write decimal pid at buf (which has room for it).
+// Used in the vfork child, so avoid anything but simple code.
+static void
+write_pid_digits(char *buf, pid_t pid)
+{
+    char digits[24];
+    int n = 0;
+    do {
+        digits[n++] = '0' + (pid % 10);
+        pid /= 10;
+    } while (pid > 0);
+    while (n > 0)
+        *buf++ = digits[--n];
+    *buf = '\0';
+}
+
 // FIXME use pclient->cmd instead of cmd etc
 static struct pty_client *
 run_command(const char *cmd, arglist_t argv, const char*cwd,
@@ -793,150 +1047,134 @@ run_command(const char *cmd, arglist_t argv, const char*cwd,
 {
     int master = pclient->pty;
     int slave = pclient->pty_slave;
-    pid_t pid = fork();
-    lwsl_notice("run_command %s after fork child:%d\n", cmd, pid);
+
+    // Prepare everything the child needs before vfork, so the child
+    // only has to do async-signal-safe system calls.  (With fork,
+    // a server with much preserved output would have to copy
+    // its page tables for each new session.)
+    if (env == NULL)
+        env = (arglist_t)environ;
+    int env_size = 0;
+    while (env[env_size] != NULL) env_size++;
+    int env_max = env_size + 10;
+    const char **nenv = (const char **) xmalloc((env_max + 1)*sizeof(const char*));
+    memcpy(nenv, env, (env_size + 1)*sizeof(const char*));
+    std::vector<char *> env_allocated;
+    char *pid_slot = NULL; // where the child writes its pid into DOMTERM
+
+    if (argv0 == nullptr || strcmp(argv0, "domterm") != 0) {
+        int dirname_length;
+        char *path;
+        if (argv0 == nullptr || argv0[0] != '/') {
+            path = get_executable_path();
+            dirname_length = get_executable_directory_length();
+        } else {
+            path = argv0;
+            char *sl = strrchr(argv0, '/');
+#if defined(_WIN32)
+            if (! sl)
+                sl = strrchr(argv0, '\\');
+#endif
+            dirname_length = sl ? sl - argv0 : -1;
+        }
+        if (dirname_length > 0) {
+            char *dpath = find_in_path("domterm");
+            if (dpath == nullptr || strcmp(path, dpath) != 0) {
+                char *old_path = getenv("PATH");
+                size_t blen = dirname_length + strlen(old_path) + 20;
+                char *buf = (char *) xmalloc(blen);
+                snprintf(buf, blen, "PATH=%.*s:%s",
+                         dirname_length, path, old_path);
+                put_to_env_array(nenv, env_max, buf);
+                env_allocated.push_back(buf);
+            }
+            free(dpath);
+        }
+    }
+    sbuf rdbuf;
+    rdbuf.printf("DOMTERM_RESOURCE_DIR=%s", get_resource_dir());
+    env_allocated.push_back(rdbuf.strdup());
+    put_to_env_array(nenv, env_max, env_allocated.back());
+    if (pclient->use_xtermjs || pclient->use_ghostty) {
+        put_to_env_array(nenv, env_max, "TERM=xterm-256color");
+    } else {
+        put_to_env_array(nenv, env_max, "TERM=xterm-domterm");
+        sbuf tibuf;
+        tibuf.printf("TERMINFO=%s",
+                     get_bin_relative_path("/share/terminfo"));
+        env_allocated.push_back(tibuf.strdup());
+        put_to_env_array(nenv, env_max, env_allocated.back());
+        put_to_env_array(nenv, env_max, "COLORTERM=truecolor");
+#ifdef LWS_LIBRARY_VERSION
+#define SHOW_LWS_LIBRARY_VERSION "=" LWS_LIBRARY_VERSION
+#else
+#define SHOW_LWS_LIBRARY_VERSION ""
+#endif
+        const char *version_info =
+            /* FIXME   tclient != NULL ? tclient->version_info
+               :*/ "version=" LDOMTERM_VERSION;
+        sbuf ebuf;
+        ebuf.printf("DOMTERM=%s;libwebsockets" SHOW_LWS_LIBRARY_VERSION,
+                    version_info);
+        // The child's tty (after dup2) is the pty slave.
+        if (pclient->ttyname != NULL)
+            ebuf.printf(";tty=%s", pclient->ttyname);
+        ebuf.printf(";session#=%d;pid=", pclient->session_number);
+        size_t pid_offset = ebuf.len;
+        ebuf.printf("%*s", 24, ""); // room for pid, filled in by child
+        char *estr = ebuf.strdup();
+        pid_slot = estr + pid_offset;
+        *pid_slot = '\0';
+        env_allocated.push_back(estr);
+        put_to_env_array(nenv, env_max, estr);
+    }
+#if ENABLE_LD_PRELOAD
+    int normal_user = getuid() == geteuid();
+    char* domterm_home = get_bin_relative_path("");
+    if (normal_user && domterm_home != NULL) {
+#if __APPLE__
+        const char *fmt =  "DYLD_INSERT_LIBRARIES=%s/lib/domterm-preloads.dylib";
+#else
+        const char *fmt =  "LD_PRELOAD=%s/lib/domterm-preloads.so libdl.so.2";
+#endif
+        size_t blen = strlen(domterm_home)+strlen(fmt)-1;
+        char *buf = (char *) xmalloc(blen);
+        snprintf(buf, blen, fmt, domterm_home);
+        env_allocated.push_back(buf);
+        put_to_env_array(nenv, env_max, buf);
+    }
+#endif
+    const char *home = cwd != NULL ? find_home() : NULL;
+    int child_stderr = slave;
+    if (pclient->stderr_client)
+        child_stderr = pclient->stderr_client->pipe_writer;
+
+    pid_t pid = vfork();
     switch (pid) {
     case -1: /* error */
-            lwsl_err("forkpty\n");
+            lwsl_err("vfork failed: %s\n", strerror(errno));
             close(master);
             close(slave);
             pclient_close(pclient, false); // ???
             break;
     case 0: { /* child */
-#if 0
-            if (login_tty(slave))
-                _exit(1);
-#else
             // Like login_tty, but optionally stderr separate
             (void) setsid();
             if (ioctl(slave, TIOCSCTTY, (char *)NULL) == -1)
 		_exit(1);
             while (dup2(slave, 0) == -1 && errno == EBUSY) {}
             while (dup2(slave, 1) == -1 && errno == EBUSY) {}
-            int child_stderr = slave;
-            if (pclient != NULL && pclient->stderr_client)
-                child_stderr = pclient->stderr_client->pipe_writer;
             while (dup2(child_stderr, 2) == -1 && errno == EBUSY) {}
-#endif
             if (cwd != NULL && chdir(cwd) != 0) {
-                const char *home = find_home();
                 if (home == NULL || chdir(home) != 0)
-                    if (chdir("/") != 0)
-                        lwsl_err("chdir failed\n");
-            }
-            if (env == NULL)
-                env = (arglist_t)environ;
-            int env_size = 0;
-            while (env[env_size] != NULL) env_size++;
-            int env_max = env_size + 10;
-            const char **nenv = (const char **) xmalloc((env_max + 1)*sizeof(const char*));
-            memcpy(nenv, env, (env_size + 1)*sizeof(const char*));
-
-            if (argv0 == nullptr || strcmp(argv0, "domterm") != 0) {
-                int dirname_length;
-                char *path;
-                if (argv0 == nullptr || argv0[0] != '/') {
-                    path = get_executable_path();
-                    dirname_length = get_executable_directory_length();
-                } else {
-                    path = argv0;
-                    char *sl = strrchr(argv0, '/');
-#if defined(_WIN32)
-                    if (! sl)
-                        sl = strrchr(argv0, '\\');
-#endif
-                    dirname_length = sl ? sl - argv0 : -1;
-                }
-                if (dirname_length > 0) {
-                    char *dpath = find_in_path("domterm");
-                    if (dpath == nullptr || strcmp(path, dpath) != 0) {
-                        char *old_path = getenv("PATH");
-                        size_t blen = dirname_length + strlen(old_path) + 20;
-                        char *buf = (char *) xmalloc(blen);
-                        snprintf(buf, blen, "PATH=%.*s:%s",
-                                dirname_length, path, old_path);
-                        put_to_env_array(nenv, env_max, buf);
-                    }
-                }
-            }
-            sbuf rdbuf;
-            rdbuf.printf("DOMTERM_RESOURCE_DIR=%s", get_resource_dir());
-            put_to_env_array(nenv, env_max, rdbuf.strdup());
-            if (pclient->use_xtermjs || pclient->use_ghostty) {
-                put_to_env_array(nenv, env_max, "TERM=xterm-256color");
-            } else {
-                put_to_env_array(nenv, env_max, "TERM=xterm-domterm");
-                sbuf tibuf;
-                tibuf.printf("TERMINFO=%s",
-                             get_bin_relative_path("/share/terminfo"));
-                put_to_env_array(nenv, env_max, tibuf.strdup());
-                put_to_env_array(nenv, env_max, "COLORTERM=truecolor");
-                const char* dinit = "DOMTERM=";
-#ifdef LWS_LIBRARY_VERSION
-#define SHOW_LWS_LIBRARY_VERSION "=" LWS_LIBRARY_VERSION
-#else
-#define SHOW_LWS_LIBRARY_VERSION ""
-#endif
-                const char *lstr = ";libwebsockets" SHOW_LWS_LIBRARY_VERSION;
-                const char* pinit = ";tty=";
-                char* ttyName = ttyname(0);
-                char pidbuf[40];
-                pid = getpid();
-                size_t dlen = strlen(dinit);
-                size_t llen = strlen(lstr);
-                size_t plen = strlen(pinit);
-                int tlen = ttyName == NULL ? 0 : strlen(ttyName);
-                const char *version_info =
-                    /* FIXME   tclient != NULL ? tclient->version_info
-                       :*/ "version=" LDOMTERM_VERSION;
-                int vlen = version_info == NULL ? 0 : strlen(version_info);
-                int mlen = dlen + vlen + llen + (tlen > 0 ? plen + tlen : 0);
-                if (pid > 0) {
-                    snprintf(pidbuf, sizeof(pidbuf), ";session#=%d;pid=%d",
-                             pclient->session_number, pid);
-                    mlen += strlen(pidbuf);
-                }
-                char* ebuf = challoc(mlen+1);
-                strcpy(ebuf, dinit);
-                int offset = dlen;
-                if (version_info)
-                    strcpy(ebuf+offset, version_info);
-                offset += vlen;
-                strcpy(ebuf+offset, lstr);
-                offset += llen;
-                if (tlen > 0) {
-                    strcpy(ebuf+offset, pinit);
-                    offset += plen;
-                    strcpy(ebuf+offset, ttyName);
-                    offset += tlen;
-                }
-                if (pid > 0) {
-                    strcpy(ebuf+offset, pidbuf);
-                    offset += strlen(pidbuf);
-                }
-                ebuf[mlen] = '\0';
-                put_to_env_array(nenv, env_max, ebuf);
-            }
-#if ENABLE_LD_PRELOAD
-            int normal_user = getuid() == geteuid();
-            char* domterm_home = get_bin_relative_path("");
-            if (normal_user && domterm_home != NULL) {
-#if __APPLE__
-                char *fmt =  "DYLD_INSERT_LIBRARIES=%s/lib/domterm-preloads.dylib";
-#else
-                char *fmt =  "LD_PRELOAD=%s/lib/domterm-preloads.so libdl.so.2";
-#endif
-                size_t blen = strlen(domterm_home)+strlen(fmt)-1;
-                char *buf = malloc(blen);
-                snprintf(buf, blen, fmt, domterm_home);
-                put_to_env_array(nenv, env_max, buf);
-            }
-#endif
-            if (execve(cmd, (char * const*)argv, (char **) nenv) < 0) {
-                perror("execvp");
-                exit(1);
+                    (void) chdir("/");
             }
-            break;
+            if (pid_slot)
+                write_pid_digits(pid_slot, getpid());
+            execve(cmd, (char * const*)argv, (char **) nenv);
+            static const char emsg[] = "domterm: exec of command failed\n";
+            (void) write(2, emsg, sizeof(emsg)-1);
+            _exit(1);
     }
     default: /* parent */
             lwsl_notice("starting application: %s session:%d pid:%d pty:%d\n",
@@ -949,16 +1187,174 @@ run_command(const char *cmd, arglist_t argv, const char*cwd,
             close(slave);
 
             pclient->pid = pid;
+            watch_notify("session-created", pclient, NULL);
             if (pclient->nrows >= 0)
                setWindowSize(pclient);
             // lws_change_pollfd ??
             // FIXME do on end: tty_client_destroy(client);
-            return pclient;
+            break;
+    }
+    for (char *str : env_allocated)
+        free(str);
+    free(nenv);
+    return pid > 0 ? pclient : NULL;
+}
+
+// Delay before refilling the prewarm pool after taking a session from it.
+#define PREWARM_REFILL_DELAY_MS 200
+// Longest delay before replacing a pooled session that exited by itself.
+#define PREWARM_RETRY_MAX_MS 60000
+
+static int
+prewarm_target()
+{
+    int n = (int) main_options->current_settings().shell_prewarm.get(0);
+    return n < 0 ? 0 : n;
+}
+
+static struct wheel_timer prewarm_refill_timer;
+// Delay before replacing a pooled session that exited; doubled each time,
+// so a shell that exits right away doesn't make us respawn it in a loop.
+static long prewarm_retry_ms = PREWARM_REFILL_DELAY_MS;
+
+static void
+prewarm_refill(struct wheel_timer *)
+{
+    prewarm_fill();
+}
+
+static void
+prewarm_refill_after(long delay_ms)
+{
+    prewarm_refill_timer.callback = prewarm_refill;
+    wheel_timer_arm(&prewarm_refill_timer,
+                    delay_ms * (LWS_USEC_PER_SEC / 1000));
+}
+
+/* Called (from pclient_close) when a session in the pool has exited. */
+static void
+prewarm_exited()
+{
+    // Not if it was stopped because the pool is too big.
+    if (prewarm_pool.size() >= (size_t) prewarm_target())
+        return;
+    lwsl_notice("prewarmed session exited; refilling pool in %ldms\n",
+                prewarm_retry_ms);
+    prewarm_refill_after(prewarm_retry_ms);
+    prewarm_retry_ms *= 2;
+    if (prewarm_retry_ms > PREWARM_RETRY_MAX_MS)
+        prewarm_retry_ms = PREWARM_RETRY_MAX_MS;
+}
+
+/** Start or stop sessions so the pool has shell.prewarm sessions. */
+void
+prewarm_fill()
+{
+    size_t target = prewarm_target();
+    for (size_t i = target; i < prewarm_pool.size(); i++) {
+        // pclient_close (when the wsi is closed) removes it from the pool.
+        lws_set_timeout(prewarm_pool[i]->pty_wsi,
+                        PENDING_TIMEOUT_SHUTDOWN_FLUSH, LWS_TO_KILL_ASYNC);
+    }
+    arglist_t argv = default_command(main_options);
+    while (argv != NULL && prewarm_pool.size() < target) {
+        char *cmd = find_in_path(argv[0]);
+        if (cmd == NULL)
+            break;
+        struct pty_client *pclient =
+            create_pclient(cmd, argv, main_options, false, nullptr, true);
+        if (pclient == NULL)
+            break;
+        // Until a window sets the real size.
+        pclient->nrows = 24;
+        pclient->ncols = 80;
+        pclient->pixh = 0;
+        pclient->pixw = 0;
+        if (run_command(cmd, argv, main_options->cwd, main_options->env,
+                        pclient) == NULL)
+            break;
+        lwsl_notice("started session %d for prewarm pool\n",
+                    pclient->session_number);
+        prewarm_pool.push_back(pclient);
+    }
+}
+
+static bool
+same_string(const char *s1, const char *s2)
+{
+    return s1 == s2 || (s1 && s2 && strcmp(s1, s2) == 0);
+}
+
+static bool
+same_strings(arglist_t a1, arglist_t a2)
+{
+    if (a1 == a2)
+        return true;
+    if (a1 == NULL || a2 == NULL)
+        return false;
+    for (; *a1 && *a2; a1++, a2++) {
+        if (strcmp(*a1, *a2) != 0)
+            return false;
     }
+    return *a1 == *a2;
+}
 
+/* Take a session from the prewarm pool, if there is one that was started
+ * just as create_pclient+run_command would start cmd/argv for opts. */
+static struct pty_client *
+prewarm_take(const char *cmd, arglist_t argv, struct options *opts)
+{
+    if (prewarm_pool.empty()
+        || ! same_string(opts->cwd, main_options->cwd)
+        || ! same_strings(opts->env, main_options->env)
+        || ! same_string(opts->tty_packet_mode, main_options->tty_packet_mode))
+        return NULL;
+#if WITH_XTERMJS
+    if (strcmp(opts->current_settings().xtermjs.get("false"),
+               main_options->current_settings().xtermjs.get("false")) != 0)
+        return NULL;
+#endif
+#if WITH_GHOSTTY
+    if (strcmp(opts->current_settings().ghostty.get("false"),
+               main_options->current_settings().ghostty.get("false")) != 0)
+        return NULL;
+#endif
+    for (auto it = prewarm_pool.begin(); it != prewarm_pool.end(); it++) {
+        struct pty_client *pclient = *it;
+        if (pclient->pid <= 0 || ! same_string(cmd, pclient->cmd)
+            || ! same_strings(argv, pclient->argv))
+            continue;
+        prewarm_pool.erase(it);
+        pclient->prewarmed = false;
+        // Already running, so nothing for start_if_needed to do.
+        free((void*)pclient->cmd); pclient->cmd = NULL;
+        free((void*)pclient->argv); pclient->argv = NULL;
+        tserver.session_count++;
+        lwsl_notice("using prewarmed session %d\n", pclient->session_number);
+        watch_notify("session-created", pclient, NULL);
+        // This shell was good for something, so stop backing off.
+        prewarm_retry_ms = PREWARM_REFILL_DELAY_MS;
+        // Refill later, after the new window is taken care of.
+        prewarm_refill_after(PREWARM_REFILL_DELAY_MS);
+        return pclient;
+    }
     return NULL;
 }
 
+/* Create a session for a new local command - from the prewarm pool
+ * if possible.  Takes ownership of cmd, like create_pclient. */
+static struct pty_client *
+new_pclient(const char *cmd, arglist_t argv, struct options *opts,
+            struct tty_client *t_hint)
+{
+    struct pty_client *pclient = prewarm_take(cmd, argv, opts);
+    if (pclient != NULL) {
+        free((void*) cmd);
+        return pclient;
+    }
+    return create_pclient(cmd, argv, opts, false, t_hint);
+}
+
 void
 pty_client::start_if_needed(struct options *opts)
 {
@@ -992,32 +1388,43 @@ find_session(const char *specifier)
             snum = -1;
     }
 
-    FOREACH_PCLIENT(pclient) {
-        if (pclient->pid == pid && pid != -1)
-            return pclient;
-        if (specifier == pclient->session_name
-            || (specifier[0] == '#' && num == pclient->session_number)
-            || (snum >= 0 && snum == pclient->session_number)) {
-            if (session != NULL)
-                return NULL; // ambiguous
-            else
-                session = pclient;
+    if (pid != -1) {
+        FOREACH_PCLIENT(pclient) {
+            if (pclient->pid == pid)
+                return pclient;
         }
     }
+    auto srange = sessions_by_name.find(specifier);
+    for (auto it = srange.first; it != srange.second; it++) {
+        if (session != NULL)
+            return NULL; // ambiguous
+        session = it->second;
+    }
+    struct pty_client *numbered =
+        pty_clients(specifier[0] == '#' ? num : snum);
+    if (numbered && numbered->prewarmed)
+        numbered = nullptr;
+    if (numbered && numbered != session) {
+        if (session != NULL)
+            return NULL; // ambiguous
+        session = numbered;
+    }
     if (session == nullptr) {
-        struct tty_client *tclient;
-        FORALL_WSCLIENT(tclient) {
-            struct pty_client *pclient = tclient->pclient;
-            if (pclient
-                && (specifier == tclient->window_name
-                    || (specifier[0] == ':'
-                        && num == tclient->connection_number))) {
+        auto wrange = windows_by_name.find(specifier);
+        for (auto it = wrange.first; it != wrange.second; it++) {
+            if (it->second->pclient) {
                 if (session != NULL)
                     return NULL; // ambiguous
-                else
-                    session = pclient;
+                session = it->second->pclient;
             }
         }
+        struct tty_client *tclient =
+            specifier[0] == ':' ? tty_clients(num) : nullptr;
+        if (tclient && tclient->pclient) {
+            if (session != NULL && tclient->window_name != specifier)
+                return NULL; // ambiguous
+            session = tclient->pclient;
+        }
         if (snum >= 0) {
             tty_client *tclient = tty_clients(snum);
             if (tclient)
@@ -1230,9 +1637,25 @@ handle_tlink(const char *tmplate, const json& obj)
     return r;
 }
 
+/** Save the window contents (malloc'ed, length bytes) received from client.
+ * Large contents are kept compressed. */
+static void
+set_saved_window(struct pty_client *pclient, struct tty_client *client,
+                 long rcount, char *contents, size_t length)
+{
+    memory_discard_window(pclient);
+    pclient->saved_window_contents = contents;
+    pclient->saved_window_sent_count = rcount;
+    client->requesting_contents = 0;
+    if (length >= SNAPSHOT_COMPRESS_MIN)
+        memory_compact_window(pclient);
+    trim_preserved(pclient);
+}
+
 static void
 backup_output(struct pty_client *pclient, char *data_start, int data_length)
 {
+    memory_restore_preserved(pclient);
     if (pclient->preserved_output == NULL) {
         pclient->preserved_start = PRESERVE_MIN;
         pclient->preserved_end = 0;
@@ -1254,6 +1677,25 @@ backup_output(struct pty_client *pclient, char *data_start, int data_length)
     pclient->preserved_end += data_length;
 }
 
+/** Send server-generated text to pclient's windows, as if it were
+ * output from the process. */
+void
+pclient_write_output(struct pty_client *pclient,
+                     const char *data, size_t length)
+{
+    if (length == 0)
+        return;
+    FOREACH_WSCLIENT(tclient, pclient) {
+        if (! tclient->out_wsi)
+            continue;
+        tclient->ob.append(data, length);
+        tclient->ocount += length;
+        lws_callback_on_writable(tclient->out_wsi);
+    }
+    if (should_backup_output(pclient))
+        backup_output(pclient, (char *) data, length);
+}
+
 static void
 handle_link(const json& obj)
 {
@@ -1365,7 +1807,7 @@ open_window(const char *data, struct options *options)
         arglist_t argv = default_command(options);
         char *cmd = find_in_path(argv[0]);
         if (cmd != NULL) {
-            npclient = create_pclient(cmd, argv, options, false, nullptr);
+            npclient = new_pclient(cmd, argv, options, nullptr);
             if (npclient && npclient->use_xtermjs)
                 wkind = xterminal_window;
             else if (npclient && npclient->use_ghostty)
@@ -1406,6 +1848,37 @@ renumber_main_window(tty_client *main_window)
     }
 }
 
+/* Send output of command.get-clipboard or command.get-selection to
+ * window cnum (if it is still there). */
+static void
+clipboard_text_received(int cnum, bool osc52, bool getting_clipboard,
+                        int px, sbuf& sb)
+{
+    struct tty_client *tclient = tty_clients(cnum);
+    if (tclient == nullptr || ! WIFEXITED(px) || WEXITSTATUS(px) != 0)
+        return;
+    if (sb.len > 0 && sb.buffer[sb.len-1] == '\n') {
+        sb.len--;
+        if (sb.len > 0 && sb.buffer[sb.len-1] == '\r')
+            sb.len--;
+    }
+    if (osc52) {
+        if (tclient->pclient == nullptr)
+            return;
+        char *response64 = base64_encode((unsigned char*) sb.buffer, sb.len);
+        sb.reset();
+        sb.printf("\033]52;%c;%s\033\\", getting_clipboard ? 'c' : 'p', response64);
+        free(response64);
+        if (write(tclient->pclient->pty, sb.buffer, sb.len) != (ssize_t) sb.len)
+            lwsl_err("write to pty failed for OSC 52 response\n");
+    } else if (tclient->out_wsi) {
+        json jobj = sb.null_terminated();
+        printf_to_browser(tclient, URGENT_WRAP("\033]231;%s\007"),
+                          jobj.dump().c_str());
+        lws_callback_on_writable(tclient->out_wsi);
+    }
+}
+
 /** Handle an "event" encoded in the stream from the browser.
  * Return true if handled.  Return false if proxyMode==proxy_local
  * and the event should be sent to the remote end.
@@ -1457,6 +1930,9 @@ reportEvent(const char *name, char *data, size_t dlen,
         strcpy(version_info, data);
         free(client->version_info);
         client->version_info = version_info;
+        json vobj = json::parse(version_info, nullptr, false);
+        client->snapshot_deflate = vobj.is_object()
+            && vobj.value("snapshot", "") == "deflate";
         if (! options->print_browser_only)
             client->unlink_main_html_filename();
         else
@@ -1474,7 +1950,7 @@ reportEvent(const char *name, char *data, size_t dlen,
         // We normally defer fork+exec until after the window is active
         // so the command can start with the correct window size.
         pclient->start_if_needed(options);
-        if (pclient->saved_window_contents != NULL
+        if (pclient_has_saved_window(pclient)
             || client->pending_requests.first())
             lws_callback_on_writable(wsi);
     } else if (strcmp(name, "RECEIVED") == 0) {
@@ -1493,6 +1969,7 @@ reportEvent(const char *name, char *data, size_t dlen,
                                 1|LWS_RXFLOW_REASON_FLAG_PROCESS_NOW);
 #endif
             pclient->paused = 0;
+            watch_notify("unpaused", pclient, client);
         }
         if (pclient != NULL)
             trim_preserved(pclient);
@@ -1506,10 +1983,14 @@ reportEvent(const char *name, char *data, size_t dlen,
         bool isCanon = true, isEchoing = true, isExtproc = false;
         struct termios trmios;
         if (pclient) {
-            int pty = pclient->pty;
+            struct pty_client *tpclient = pclient;
             if (pclient->cur_pclient && pclient->cur_pclient->cmd_socket >= 0)
-                pty = pclient->cur_pclient->pty;
-            if (tcgetattr(pty, &trmios) < 0)
+                tpclient = pclient->cur_pclient;
+            // While paused we don't read the pty, so we may have missed
+            // a change notification.
+            if (tpclient->termios_cached && ! tpclient->paused)
+                trmios = tpclient->cached_termios;
+            else if (tcgetattr(tpclient->pty, &trmios) < 0)
                 ; //return -1;
             isCanon = (trmios.c_lflag & ICANON) != 0;
             isEchoing = (trmios.c_lflag & ECHO) != 0;
@@ -1522,10 +2003,21 @@ reportEvent(const char *name, char *data, size_t dlen,
             trmios.c_cc[VSUSP] = 032;
             trmios.c_cc[VQUIT] = 034;
         }
-        json obj = json::parse(q2+1, nullptr, false);
-        std::string str = obj.is_string() ? obj : "";
-        const char *kstr = str.c_str();
-        int klen = str.length();
+        // Usually the key is a JSON string without escapes,
+        // so we can use it as-is, without json::parse.
+        const char *kstr = q2 + 1;
+        int klen = data + dlen - kstr;
+        std::string str;
+        if (klen >= 2 && kstr[0] == '"' && kstr[klen-1] == '"'
+            && memchr(kstr + 1, '\\', klen - 2) == NULL) {
+            kstr++;
+            klen -= 2;
+        } else {
+            json obj = json::parse(q2+1, nullptr, false);
+            str = obj.is_string() ? obj : "";
+            kstr = str.c_str();
+            klen = str.length();
+        }
         int kstr0 = klen != 1 ? -1 : kstr[0];
         if (isCanon
             && kstr0 != trmios.c_cc[VINTR]
@@ -1547,6 +2039,7 @@ reportEvent(const char *name, char *data, size_t dlen,
             }
             lwsl_info("report KEY pty:%d canon:%d echo:%d klen:%d\n",
                       pclient->pty, isCanon, isEchoing, klen);
+            pclient->last_input_us = monotonic_usec();
 #if defined(TIOCSIG)
             bool packet_mode = isExtproc && (trmios.c_lflag & ISIG) != 0;
             int ch0 = isCanon ? kstr0 : -1;
@@ -1657,6 +2150,7 @@ reportEvent(const char *name, char *data, size_t dlen,
         if (pclient != NULL) {
             if (pclient->detach_count >= 0)
                 pclient->detach_count++;
+            memory_restore_preserved(pclient);
             if (pclient->preserved_output == NULL
                 && wclient->requesting_contents == 0)
                 wclient->requesting_contents = 1;
@@ -1722,38 +2216,25 @@ reportEvent(const char *name, char *data, size_t dlen,
         bool getting_clipboard = strcmp(name, "REQUEST-CLIPBOARD-TEXT") == 0;
         if (options == NULL)
             options = main_options;
-        std::string get_clipboard_cmd =
-            get_setting_s(options->settings,
-                          getting_clipboard ? "command.get-clipboard"
-                          : "command.get-selection");
+        const settings_snapshot& settings = options->current_settings();
+        std::string get_clipboard_cmd = getting_clipboard
+            ? settings.command_get_clipboard.get()
+            : settings.command_get_selection.get();
         if (get_clipboard_cmd.empty()) {
             const char *cmd = get_clipboard_command(getting_clipboard ? "paste" : "selection-paste");
             if (cmd)
                 get_clipboard_cmd = cmd;
         }
-        struct sbuf sb;
-        int px;
-        if (! get_clipboard_cmd.empty()
-            && ((px = popen_read(get_clipboard_cmd.c_str(), sb)), WIFEXITED(px) && WEXITSTATUS(px) == 0)) {
-            if (sb.len > 0 && sb.buffer[sb.len-1] == '\n') {
-                sb.len--;
-                if (sb.len > 0 && sb.buffer[sb.len-1] == '\r')
-                    sb.len--;
-            }
-            if (strcmp(data, "OSC52") == 0) {
-                char *response64 = base64_encode((unsigned char*) sb.buffer, sb.len);
-                sb.reset();
-                sb.printf("\033]52;%c;%s\033\\", getting_clipboard ? 'c' : 'p', response64);
-                free(response64);
-                if (write(pclient->pty, sb.buffer, sb.len) != sb.len)
-                    lwsl_err("write to pty failed for OSC 52 response\n");
-            } else {
-                json jobj = sb.null_terminated();
-                printf_to_browser(client, URGENT_WRAP("\033]231;%s\007"),
-                                  jobj.dump().c_str());
-                lws_callback_on_writable(wsi);
-            }
-        }
+        // The clipboard command may be slow, so respond when it is done.
+        int cnum = client->connection_number;
+        bool osc52 = strcmp(data, "OSC52") == 0;
+        if (! get_clipboard_cmd.empty())
+            start_subprocess(get_clipboard_cmd.c_str(), true,
+                             [=](int px, sbuf& sb) {
+                                 clipboard_text_received(cnum, osc52,
+                                                         getting_clipboard,
+                                                         px, sb);
+                             });
     } else if (strcmp(name, "WINDOW-CONTENTS") == 0) {
         if (proxyMode == proxy_display_local)
             return false;
@@ -1765,12 +2246,58 @@ reportEvent(const char *name, char *data, size_t dlen,
         if ((updated & ((MASK28+1)>>1)) != 0) {
             return true;
         }
-        if (pclient->saved_window_contents != NULL)
-            free(pclient->saved_window_contents);
-        pclient->saved_window_contents = strdup(q+1);
-        client->requesting_contents = 0;
-        pclient->saved_window_sent_count = rcount;
-        trim_preserved(pclient);
+        trace_operation("WINDOW-CONTENTS");
+        size_t clen = data + dlen - (q+1);
+        char *contents = challoc(clen + 1);
+        memcpy(contents, q+1, clen);
+        contents[clen] = '\0';
+        set_saved_window(pclient, client, rcount, contents, clen);
+    } else if (strcmp(name, "WINDOW-CONTENTS-DELTA") == 0) {
+        // Data is: rcount,base_rcount,base_length,prefix,suffix,middle
+        // The new contents are the first prefix bytes of the saved
+        // window contents (which must have been sent at base_rcount and
+        // have base_length bytes), then middle, then the last suffix bytes.
+        if (proxyMode == proxy_display_local)
+            return false;
+        long rcount, base_rcount, base_length, prefix, suffix;
+        int mstart = -1;
+        sscanf(data, "%ld,%ld,%ld,%ld,%ld,%n", &rcount, &base_rcount,
+               &base_length, &prefix, &suffix, &mstart);
+        if (mstart < 0)
+            return true;
+        int updated = (rcount - pclient->saved_window_sent_count) & MASK28;
+        if ((updated & ((MASK28+1)>>1)) != 0) {
+            return true;
+        }
+        trace_operation("WINDOW-CONTENTS-DELTA");
+        memory_restore_window(pclient);
+        const char *base = pclient->saved_window_contents;
+        if (base == NULL || pclient->saved_window_sent_count != base_rcount
+            || (long) strlen(base) != base_length
+            || prefix < 0 || suffix < 0 || prefix + suffix > base_length) {
+            lwsl_notice("WINDOW-CONTENTS-DELTA from conn#%d doesn't match saved window - requesting full contents\n",
+                        client->connection_number);
+            printf_to_browser(client, "%s", request_full_contents_message);
+            client->requesting_contents = 2;
+            return true;
+        }
+        size_t mlen = dlen - mstart;
+        size_t clen = prefix + mlen + suffix;
+        char *contents = challoc(clen + 1);
+        memcpy(contents, base, prefix);
+        memcpy(contents + prefix, data + mstart, mlen);
+        memcpy(contents + prefix + mlen, base + base_length - suffix, suffix);
+        contents[clen] = '\0';
+        set_saved_window(pclient, client, rcount, contents, clen);
+    } else if (strcmp(name, "REQUEST-SETTINGS") == 0) {
+        // The browser couldn't apply a settings delta.
+        client->settings_sent = -1;
+        client->uploadSettingsNeeded = true;
+        lws_callback_on_writable(client->out_wsi);
+    } else if (strcmp(name, "PROXY-COMPRESS") == 0) {
+        // Sent by the local server (see proxy-compress.cc).
+        if (proxyMode == proxy_remote)
+            proxy_deflate_start(client, data);
     } else if (strcmp(name, "LOG") == 0) {
         static bool note_written = false;
         if (! note_written)
@@ -1854,6 +2381,7 @@ tty_client::tty_client()
     this->is_primary_window = false;
     this->close_requested = false;
     this->keep_after_unexpected_close = true;
+    this->snapshot_deflate = false;
     this->detach_on_disconnect = true;
     this->detachSaveSend = false;
     this->uploadSettingsNeeded = true;
@@ -1865,6 +2393,7 @@ tty_client::tty_client()
     this->pclient = NULL;
     this->sent_count = 0;
     this->confirmed_count = 0;
+    this->ob.set_headroom(LWS_PRE + OB_HEADER_ROOM);
     this->ob.extend(20000);
     this->ocount = 0;
     this->proxyMode = no_proxy; // FIXME
@@ -1873,6 +2402,7 @@ tty_client::tty_client()
     this->pty_window_number = -1;
     this->pty_window_update_needed = false;
     this->ssh_connection_info = NULL;
+    this->proxy_deflate = NULL;
     this->next_tclient = NULL;
     lwsl_notice("init_tclient_struct conn#%d\n",  this->connection_number);
 }
@@ -1887,19 +2417,26 @@ handle_input(struct lws *wsi, struct tty_client *client,
 {
     if (main_options->readonly)
         return 0;
-    size_t clen = client->inb.len;
-    unsigned char *msg = (unsigned char*) client->inb.buffer;
+    size_t clen = client->inb.data_length();
+    unsigned char *msg = (unsigned char*) client->inb.data();
     struct pty_client *pclient = client->pclient;
     if (pclient)
         pclient->recent_tclient = client;
     // FIXME handle PENDING
     size_t start = 0;
-    lwsl_info("handle_input len:%zu conn#%d pmode:%d pty:%d\n", clen, client->connection_number, proxyMode, pclient==NULL? -99 : pclient->pty);
+    dtlog(LLL_INFO, "handle_input len:%ld conn#%ld pmode:%ld pty:%ld\n",
+          (long) clen, (long) client->connection_number, (long) proxyMode,
+          pclient==NULL? -99L : (long) pclient->pty);
     for (size_t i = 0; ; i++) {
         if (i == clen || msg[i] == REPORT_EVENT_PREFIX) {
             int w = i - start;
             if (w > 0)
-                lwsl_notice(" -handle_input write start:%zu w:%d\n", start, w);
+                dtlog(LLL_INFO, " -handle_input write start:%ld w:%ld\n",
+                      (long) start, (long) w);
+            if (w > 0 && pclient) {
+                trace_operation("pty write");
+                pclient->last_input_us = monotonic_usec();
+            }
             if (w > 0 && pclient && write(pclient->pty, msg+start, w) < w) {
                 lwsl_err("write INPUT to pty\n");
                 return -1;
@@ -1947,17 +2484,73 @@ handle_input(struct lws *wsi, struct tty_client *client,
             start = i+1;
         }
     }
-    if (start < clen) {
-        memmove(client->inb.buffer, client->inb.buffer+start, clen-start);
-        client->inb.len = clen - start;
-    }
-    else if (client->inb.size > 2048)
+    client->inb.consume(start);
+    if (start == clen && client->inb.size > 2048)
         client->inb.reset();
-    else
-        client->inb.len = 0;
     return 0;
 }
 
+/** Write to a proxy's fd_out.  What can't be written now (the pipe is
+ * full) is queued in proxy_pending, and written by proxy_flush
+ * when the fd is writable.  Returns false on a write error. */
+static bool
+proxy_write(struct tty_client *client, const char *data, size_t len)
+{
+    if (client->proxy_pending.data_length() == 0) {
+        ssize_t n = write(client->options->fd_out, data, len);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EINTR)
+                return false;
+            n = 0;
+        }
+        data += n;
+        len -= n;
+    }
+    if (len > 0) {
+        client->proxy_pending.append(data, len);
+        proxy_deflate_congested(client);
+        lws_callback_on_writable(client->out_wsi);
+    }
+    return true;
+}
+
+/** Write queued output of a proxy.
+ * Returns 1 if all was written, 0 if some is still queued,
+ * or -1 on a write error. */
+static int
+proxy_flush(struct tty_client *client)
+{
+    rbuf& pending = client->proxy_pending;
+    if (pending.data_length() == 0)
+        return 1;
+    ssize_t n = write(client->options->fd_out,
+                      pending.data(), pending.data_length());
+    if (n < 0)
+        return errno == EAGAIN || errno == EINTR ? 0 : -1;
+    pending.consume(n);
+    dtlog(LLL_INFO, "proxy flush conn#%ld wrote:%ld pending:%ld\n",
+          (long) client->connection_number, (long) n,
+          (long) pending.data_length());
+    struct pty_client *pclient = client->pclient;
+    if (pending.data_length() < MAX_PROXY_PENDING / 2
+        && pclient != NULL && pclient->paused
+        && ((client->sent_count - client->confirmed_count) & MASK28) < MAX_CONTINUE) {
+#if USE_RXFLOW
+        lwsl_info("session %d unpaused (proxy output written)\n",
+                  pclient->session_number);
+        lws_rx_flow_control(pclient->pty_wsi,
+                            1|LWS_RXFLOW_REASON_FLAG_PROCESS_NOW);
+#endif
+        pclient->paused = 0;
+        watch_notify("unpaused", pclient, client);
+    }
+    if (pending.data_length() > 0)
+        return 0;
+    if (pending.size > 40000)
+        pending.reset();
+    return 1;
+}
+
 static int
 handle_output(struct tty_client *client,  enum proxy_mode proxyMode, bool to_proxy)
 {
@@ -1968,13 +2561,16 @@ handle_output(struct tty_client *client,  enum proxy_mode proxyMode, bool to_pro
             memchr(client->ob.buffer, 0xFD, client->ob.len);
         lwsl_notice("check for FD: %p text[%.*s] pclient:%p\n", fd, (int) client->ob.len, client->ob.buffer, pclient);
         if (fd && pclient) {
-            client->ob.len = 0; // FIXME - simplified
             struct termios termios;
             if (tcgetattr(pclient->pty, &termios) == 0) {
                 termios.c_lflag &= ~(ICANON|ECHO);
                 termios.c_oflag &= ~ONLCR;
                 tcsetattr(pclient->pty, TCSANOW, &termios);
             }
+            proxy_compress_request(pclient, client->options, (char *) fd,
+                                   client->ob.buffer + client->ob.len
+                                   - (char *) fd);
+            client->ob.len = 0; // FIXME - simplified
             tty_restore(-1);
             //client->proxyMode = proxy_display_local;
 
@@ -2011,16 +2607,31 @@ handle_output(struct tty_client *client,  enum proxy_mode proxyMode, bool to_pro
         }
     }
 
-    lwsl_info("handle_output conn#%d initialized:%d pmode:%d len0:%zu pty_up_n:%d\n", client->connection_number, client->initialized, proxyMode, client->ob.len, client->pty_window_update_needed);
-    sbuf sb;
+    dtlog(LLL_INFO, "handle_output conn#%ld initialized:%ld pmode:%ld len0:%ld pty_up_n:%ld\n",
+          (long) client->connection_number, (long) client->initialized,
+          (long) proxyMode, (long) client->ob.len,
+          (long) client->pty_window_update_needed);
+    sbuf sb; // messages to send before ob
     if (! to_proxy)
-        sb.blank(LWS_PRE);
+        sb.set_headroom(LWS_PRE);
     if (client->uploadSettingsNeeded) { // proxyMode != proxy_local ???
         client->uploadSettingsNeeded = false;
-        if (! settings_as_json.empty()) {
-            sb.printf(URGENT_WRAP("\033]89;%s\007"), settings_as_json.c_str());
+        if (! settings_as_json.empty()
+            && client->settings_sent != settings_counter) {
+            // A browser that has the previous settings only needs the
+            // changed keys.  (Don't bother for proxies: the remote and
+            // local settings are mixed up in the browser anyway.)
+            bool delta = ! settings_delta_as_json.empty()
+                && proxyMode == no_proxy
+                && client->settings_sent == settings_counter - 1;
+            sb.printf(URGENT_WRAP("\033]89;%s\007"),
+                      delta ? settings_delta_as_json.c_str()
+                      : settings_as_json.c_str());
+            client->settings_sent = settings_counter;
         }
     }
+    if ((client->initialized >> 1) == 0 && pclient)
+        memory_restore_preserved(pclient);
     if (client->initialized == 0 && proxyMode != proxy_command_local && proxyMode != proxy_remote) {
         if (client->options && client->options->cmd_settings.is_object()) {
             tty_client *mclient = client->main_window <= 0 ? client
@@ -2044,14 +2655,28 @@ handle_output(struct tty_client *client,  enum proxy_mode proxyMode, bool to_pro
             sb.printf(URGENT_WRAP("\033]30;%s\007"),
                       pclient->session_name.c_str());
         }
-        if (pclient && pclient->saved_window_contents != NULL) {
+        if (pclient && pclient_has_saved_window(pclient)) {
             int rcount = pclient->saved_window_sent_count;
-            sb.printf(URGENT_WRAP("\033]103;%ld,%s\007"),
-                      (long) rcount, (char *) pclient->saved_window_contents);
+            // The contents may be many megabytes, so append them directly
+            // (compressed if the client can handle that) rather than
+            // using printf.
+            sb.printf(URGENT_START_STRING "\033]103;%ld,", (long) rcount);
+            bool compressed = client->snapshot_deflate
+                && snapshot_append_compressed(pclient, sb);
+            if (! compressed) {
+                memory_restore_window(pclient);
+                sb.append(pclient->saved_window_contents);
+            }
+            sb.append("\007" URGENT_END_STRING);
             client->sent_count = rcount;
             if (pclient->preserve_mode < 2) {
-                free(pclient->saved_window_contents);
-                pclient->saved_window_contents = NULL;
+                // The client has it now.  If it was sent compressed,
+                // the client may send WINDOW-CONTENTS-DELTA against it,
+                // so keep it (compressed) as the base for that.
+                if (compressed)
+                    pclient->saved_window_is_base = true;
+                else
+                    memory_discard_window(pclient);
             }
         }
     }
@@ -2062,6 +2687,12 @@ handle_output(struct tty_client *client,  enum proxy_mode proxyMode, bool to_pro
         long read_count = pclient->preserved_sent_count + (pend - pstart);
         long rcount = client->sent_count;
         size_t unconfirmed = (read_count - rcount - client->ocount) & MASK28;
+        if (unconfirmed > pend - pstart && pclient->history_evicted) {
+            // The oldest output was discarded by memory_check,
+            // so replay what is left.
+            unconfirmed = pend - pstart;
+            rcount = (read_count - client->ocount - unconfirmed) & MASK28;
+        }
         if (unconfirmed > 0 && pend - pstart >= unconfirmed) {
             pstart = pend - unconfirmed;
             sb.append(start_replay_mode);
@@ -2107,71 +2738,109 @@ handle_output(struct tty_client *client,  enum proxy_mode proxyMode, bool to_pro
         sb.printf(URGENT_WRAP("\033[82;%du"), code);
         client->detachSaveSend = false;
     }
-    if (client->ob.len > 0) {
+    sbuf& ob = client->ob;
+    // A NULL ob.buffer means we've sent eof_message (see below).
+    bool ob_released = ob.buffer == NULL;
+    if (ob.len > 0) {
         //  // proxyMode != proxy_local ??? for count?
         client->sent_count = (client->sent_count + client->ocount) & MASK28;
-        sb.append(client->ob);
         client->ocount = 0;
-        if (client->ob.size > 40000) {
-            client->ob.reset();
-            client->ob.extend(20000);
-        }
-        client->ob.len = 0;
     }
+    // Messages to send after the pty output are appended to ob itself.
     for (struct options *request = client->pending_requests.first();
          request != nullptr;
          request = client->pending_requests.next(request)) {
         std::string& crequest = request->unsent_request;
         if (! crequest.empty()) {
-            sb.printf(URGENT_WRAP("\033]97;%s\007"), crequest.c_str());
+            ob.printf(URGENT_WRAP("\033]97;%s\007"), crequest.c_str());
             crequest = "";
         }
     }
     if (client->requesting_contents == 1) { // proxyMode != proxy_local ???
-        sb.printf("%s", request_contents_message);
+        ob.printf("%s", request_contents_message);
         client->requesting_contents = 2;
     }
     if (pclient==NULL)
-        lwsl_notice("- empty pclient buf:%d for %p\n", client->ob.buffer != NULL, client);
+        lwsl_notice("- empty pclient buf:%d for %p\n", ob.buffer != NULL, client);
+    bool release_ob = false;
     if (! pclient
         && (client->wkind == dterminal_window
             || client->wkind == ghterminal_window
             || client->wkind == xterminal_window)
-        && client->ob.buffer != NULL
+        && ! ob_released
         && proxyMode != proxy_command_local) {
         if (proxyMode != proxy_display_local) {
             client->keep_after_unexpected_close = false;
-            sb.printf("%s", eof_message);
+            ob.printf("%s", eof_message);
         }
-        client->ob.reset();
+        release_ob = true;
     }
 
     if (client->initialized >= 0)
         client->initialized = 2;
 
+    // Usually the messages in sb are short and fit in the headroom of ob,
+    // so we don't need to copy ob.  Otherwise (for example when sending
+    // saved window contents) append ob to sb.
+    // Either way there is LWS_PRE space before out, as lws_write needs.
+    char *out;
+    size_t out_len;
+    if (sb.len <= OB_HEADER_ROOM && ob.buffer != NULL) {
+        out = ob.buffer - sb.len;
+        if (sb.len > 0)
+            memcpy(out, sb.buffer, sb.len);
+        out_len = sb.len + ob.len;
+    } else {
+        sb.append(ob);
+        out = sb.buffer;
+        out_len = sb.len;
+    }
+
     if (to_proxy) {
-        if (sb.len > 0 && proxyMode == proxy_remote && client->options) {
+        if (out_len > 0 && proxyMode == proxy_remote && client->options) {
             long output_timeout = client->options->remote_output_interval;
             if (output_timeout)
-                lws_set_timer_usecs(client->out_wsi, output_timeout * (LWS_USEC_PER_SEC / 1000));
+                wheel_timer_arm(&client->keepalive_timer,
+                                output_timeout * (LWS_USEC_PER_SEC / 1000));
         }
         if (client->pclient == NULL) {
-            lwsl_notice("proxy WRITABLE/close blen:%zu\n", sb.len);
+            lwsl_notice("proxy WRITABLE/close blen:%zu\n", out_len);
         }
-        // data in tclient->ob.
-        size_t n = write(client->options->fd_out, sb.buffer, sb.len);
-        lwsl_notice("proxy RAW_WRITEABLE %d len:%zu written:%zu pclient:%p\n",
-                    client->options->fd_out, sb.len, n, client->pclient);
+        if (client->proxy_deflate
+            && ! proxy_deflate_output(client, &out, &out_len)) {
+            lwsl_err("compressing output for conn#%d failed\n",
+                     client->connection_number);
+            return -1;
+        }
+        if (out_len > 0 && ! proxy_write(client, out, out_len))
+            lwsl_err("proxy write to %d failed: %s\n",
+                     client->options->fd_out, strerror(errno));
+        lwsl_notice("proxy RAW_WRITEABLE %d len:%zu pending:%zu pclient:%p\n",
+                    client->options->fd_out, out_len,
+                    client->proxy_pending.data_length(), client->pclient);
     } else {
         struct lws *wsi = client->wsi;
-        int written = sb.len - LWS_PRE;
-        lwsl_info("tty SERVER_WRITEABLE conn#%d written:%d sent: %ld to %p\n", client->connection_number, written, (long) client->sent_count, wsi);
+        int written = out_len;
+        dtlog(LLL_INFO, "tty SERVER_WRITEABLE conn#%ld written:%ld sent: %ld to %lx\n",
+              (long) client->connection_number, (long) written,
+              (long) client->sent_count, (long) wsi);
         if (written > 0
-            && lws_write(wsi, (unsigned char*) sb.buffer+LWS_PRE,
+            && lws_write(wsi, (unsigned char*) out,
                          written, LWS_WRITE_BINARY) != written)
             lwsl_err("lws_write\n");
     }
-    return to_proxy && client->pclient == NULL ? -1 : 0;
+    if (release_ob)
+        ob.reset();
+    else {
+        if (ob.size > 40000) {
+            ob.reset();
+            ob.extend(20000);
+        }
+        ob.len = 0;
+    }
+    // Close a proxy whose session ended, once its output is written.
+    return to_proxy && client->pclient == NULL
+        && client->proxy_pending.data_length() == 0 ? -1 : 0;
 }
 
 #if 0
@@ -2194,6 +2863,39 @@ get_elapsed_time_ms ()
 }
 #endif
 
+// The remote end of ssh has sent nothing for remote-output-interval.
+static void
+proxy_keepalive(struct wheel_timer *timer)
+{
+    struct tty_client *tclient = (struct tty_client *) timer->data;
+    lwsl_info("conn#%d: send keepalive\n", tclient->connection_number);
+    printf_to_browser(tclient, URGENT_WRAP(""));
+    lws_callback_on_writable(tclient->out_wsi);
+}
+
+// The local end of ssh got no output for remote-output-timeout.
+static void
+remote_output_timed_out(struct wheel_timer *timer)
+{
+    struct pty_client *pclient = (struct pty_client *) timer->data;
+    lwsl_notice("session %d: no output from remote - timed out\n",
+                pclient->session_number);
+    // pclient_close reports the time-out to the windows.
+    pclient->timed_out = true;
+    lws_set_timeout(pclient->pty_wsi, PENDING_TIMEOUT_SHUTDOWN_FLUSH,
+                    LWS_TO_KILL_ASYNC);
+}
+
+// The remote end of ssh got no input for remote-input-timeout.
+static void
+proxy_input_timed_out(struct wheel_timer *timer)
+{
+    struct tty_client *tclient = (struct tty_client *) timer->data;
+    lwsl_notice("conn#%d: no input - timed out\n", tclient->connection_number);
+    lws_set_timeout(tclient->wsi, PENDING_TIMEOUT_SHUTDOWN_FLUSH,
+                    LWS_TO_KILL_ASYNC);
+}
+
 int
 callback_proxy(struct lws *wsi, enum lws_callback_reasons reason,
                void *user, void *in, size_t len)
@@ -2204,28 +2906,15 @@ callback_proxy(struct lws *wsi, enum lws_callback_reasons reason,
         lwsl_info("callback_proxy wsi:%p reason:%d - no client\n", wsi, reason);
     else
         lwsl_info("callback_proxy wsi:%p reason:%d fd:%d conn#%d\n", wsi, reason, tclient==NULL||tclient->options==NULL? -99 : tclient->options->fd_in, tclient->connection_number);
+    callback_scope scope("proxy", reason, len);
+    if (tclient)
+        scope.connection = tclient->connection_number;
     switch (reason) {
     case LWS_CALLBACK_RAW_CLOSE_FILE:
         lwsl_notice("proxy RAW_CLOSE_FILE\n");
         if (tclient->wsi == wsi)
             tclient->~tty_client();
         return 0;
-    case LWS_CALLBACK_TIMER:
-        lwsl_notice("proxy CALLBACK_TIMER\n");
-        if (tclient->proxyMode == proxy_remote && tclient->options) {
-            if (wsi == tclient->wsi) {
-                return -1;
-            }
-            long output_interval = tclient->options->remote_output_interval;
-            if (output_interval) {
-                lwsl_info("- CALLBACK_TIMER send ping\n");
-                printf_to_browser(tclient, URGENT_WRAP(""));
-                lws_callback_on_writable(tclient->out_wsi);
-                lws_set_timer_usecs(tclient->out_wsi, output_interval * (LWS_USEC_PER_SEC / 1000));
-            }
-        }
-        return 0;
-
     case LWS_CALLBACK_RAW_RX_FILE: ;
         if (tclient->options->fd_in < 0) {
             lwsl_info("proxy RAW_RX_FILE - no fd cleanup\n");
@@ -2235,14 +2924,15 @@ callback_proxy(struct lws *wsi, enum lws_callback_reasons reason,
         if (tclient->proxyMode == proxy_remote && tclient->options) {
             long input_timeout = tclient->options->remote_input_timeout;
             if (input_timeout)
-                lws_set_timer_usecs(tclient->wsi, input_timeout * (LWS_USEC_PER_SEC / 1000));
+                wheel_timer_arm(&tclient->input_timer,
+                                input_timeout * (LWS_USEC_PER_SEC / 1000));
         }
         // read data, send to
-        tclient->inb.extend(1024);
+        tclient->inb.reserve(1024);
         n = read(tclient->options->fd_in,
                  tclient->inb.avail_start(), tclient->inb.avail_space());
-        lwsl_info("proxy RAW_RX_FILE n:%ld avail:%zu-%zu\n",
-                    (long) n, tclient->inb.size, tclient->inb.len);
+        dtlog(LLL_INFO, "proxy RAW_RX_FILE n:%ld avail:%ld-%ld\n",
+              (long) n, (long) tclient->inb.size, (long) tclient->inb.len);
         if (n <= 0) {
             return n < 0 && errno == EAGAIN ? 0 : -1;
         }
@@ -2253,6 +2943,16 @@ callback_proxy(struct lws *wsi, enum lws_callback_reasons reason,
             lwsl_info("proxy RAW_WRITEABLE_FILE - no fd cleanup\n");
             return -1;
         }
+        // Earlier output first; meanwhile new output stays in ob.
+        switch (proxy_flush(tclient)) {
+        case -1:
+            lwsl_err("proxy write to %d failed: %s\n",
+                     tclient->options->fd_out, strerror(errno));
+            return -1;
+        case 0:
+            lws_callback_on_writable(wsi);
+            return 0;
+        }
         return handle_output(tclient, tclient->proxyMode, true);
     default:
         return 0;
@@ -2267,9 +2967,16 @@ callback_tty(struct lws *wsi, enum lws_callback_reasons reason,
 {
     struct tty_client *client = WSI_GET_TCLIENT(wsi);
     struct pty_client *pclient = client == NULL ? NULL : client->pclient;
-    lwsl_info("callback_tty %p reason:%d conn%s%d\n", wsi, (int) reason,
-              client != nullptr && client->main_window == 0 ? "^" : "#" ,
-              client == NULL ? -1 : client->connection_number);
+    dtlog(LLL_INFO, "callback_tty %lx reason:%ld conn#%ld main-window:%ld\n",
+          (long) wsi, (long) reason,
+          client == NULL ? -1L : (long) client->connection_number,
+          client == NULL ? -1L : (long) client->main_window);
+    callback_scope scope("tty", reason, len);
+    if (client) {
+        scope.connection = client->connection_number;
+        if (pclient)
+            scope.session = pclient->session_number;
+    }
 
     switch (reason) {
     case LWS_CALLBACK_FILTER_PROTOCOL_CONNECTION:
@@ -2409,7 +3116,7 @@ callback_tty(struct lws *wsi, enum lws_callback_reasons reason,
                 arglist_t argv = default_command(main_options);
                 char *cmd = find_in_path(argv[0]);
                 if (cmd != NULL) {
-                    pclient = create_pclient(cmd, argv, main_options, false, client);
+                    pclient = new_pclient(cmd, argv, main_options, client);
                     link_command(wsi, client, pclient);
                     lwsl_info("connection to new session %d established\n",
                               pclient->session_number);
@@ -2454,7 +3161,7 @@ callback_tty(struct lws *wsi, enum lws_callback_reasons reason,
         }
          // receive data from websockets client (browser)
          //fprintf(stderr, "callback_tty CALLBACK_RECEIVE len:%d\n", (int) len);
-        client->inb.extend(len < 1024 ? 1024 : len + 1);
+        client->inb.reserve(len < 1024 ? 1024 : len + 1);
         client->inb.append((char *) in, len);
         //((unsigned char*)client->inb.buffer)[client->inb.len] = '\0'; // ??
         // check if there are more fragmented messages
@@ -2511,6 +3218,14 @@ make_proxy(struct options *options, struct pty_client *pclient, enum proxy_mode
     // If proxy_remote, use two lws objects because it simplifies timer handling
     if (proxyMode == proxy_remote && fd_out == fd_in)
         fd_out = dup(fd_out);
+    // The output of a remote is a pipe to ssh.  Writing to it must not
+    // block the server when it is full; see proxy_write.
+    // (A local fd_out may be the user's terminal, which we leave alone.)
+    if (proxyMode == proxy_remote) {
+        int flags = fcntl(fd_out, F_GETFL);
+        if (flags >= 0)
+            fcntl(fd_out, F_SETFL, flags | O_NONBLOCK);
+    }
     lws_sock_file_fd_type fd;
     fd.filefd = fd_in;
     struct lws *pin_lws =
@@ -2522,6 +3237,10 @@ make_proxy(struct options *options, struct pty_client *pclient, enum proxy_mode
     lwsl_notice("make_proxy in:%d out:%d mode:%d in-conn#%d pin-wsi:%p in-tname:%s\n", options->fd_in, options->fd_out, proxyMode, tclient->connection_number, pin_lws, ttyname(options->fd_in));
     tclient->proxyMode = proxyMode;
     tclient->link_pclient(pclient);
+    tclient->keepalive_timer.callback = proxy_keepalive;
+    tclient->keepalive_timer.data = tclient;
+    tclient->input_timer.callback = proxy_input_timed_out;
+    tclient->input_timer.data = tclient;
     const char *ssh_connection;
     if (proxyMode == proxy_remote
         && (ssh_connection = getenv_from_array("SSH_CONNECTION", options->env)) != NULL) {
@@ -2561,11 +3280,10 @@ display_pipe_session(struct options *options, struct pty_client *pclient)
         printf_to_browser(tclient, URGENT_WRAP(""));
     }
     lwsl_notice("should write open-window message\n");
-    const char *s =  "\xFDREMOTE-WINDOW \n";
-    int sl = strlen(s);
-    int nn;
-    if ((nn = write(options->fd_out, s, sl)) != sl)
-        lwsl_notice("bad write n:%d err:%s\n", (int)nn, strerror(errno));
+    // See proxy-compress.cc for "compress=deflate".
+    const char *s =  "\xFDREMOTE-WINDOW compress=deflate\n";
+    if (! proxy_write(tclient, s, strlen(s)))
+        lwsl_notice("bad write err:%s\n", strerror(errno));
     //printf_to_browser(client, URGENT_WRAP("open-window"));
     //lws_callback_on_writable(wsi);
     //daemonize client
@@ -2590,7 +3308,7 @@ int new_action(int argc, arglist_t argv, struct options *opts)
         printf_error(opts, "cannot execute '%s'", argv0);
         return EXIT_FAILURE;
     }
-    struct pty_client *pclient = create_pclient(cmd, args, opts, false, NULL);
+    struct pty_client *pclient = new_pclient(cmd, args, opts, NULL);
     int r = display_terminal_session(opts, pclient);
     if (r == EXIT_FAILURE) {
         lws_set_timeout(pclient->pty_wsi, PENDING_TIMEOUT_SHUTDOWN_FLUSH, LWS_TO_KILL_SYNC);
@@ -2665,8 +3383,7 @@ int browse_action(int argc, arglist_t argv, struct options *opts)
         return EXIT_FAILURE;
     }
     const char *url = argv[optind];
-    display_session(opts, NULL, url, browser_window);
-    return EXIT_SUCCESS;
+    return display_session(opts, NULL, url, browser_window);
 }
 
 void
@@ -2759,6 +3476,48 @@ expand_host_conditional(const char *expr, const char *host)
     return r;
 }
 
+/* Extra ssh arguments so all sessions to the same user@host:port share
+ * a single ssh connection (OpenSSH connection multiplexing).
+ * The first ssh becomes the "master", and stays in the background
+ * for remote-multiplex seconds after the last session using it ends.
+ * Later sessions only need to open a channel over the master connection
+ * (one round trip), instead of a new handshake and authentication.
+ * Each session is still its own ssh channel, with ssh's per-channel
+ * flow control. */
+static std::vector<std::string>
+ssh_multiplex_args(struct options *opts, argblob_t ssh_args)
+{
+    std::vector<std::string> args;
+    std::string persist =
+        opts->current_settings().remote_multiplex.get("60");
+    int bval = bool_value(persist.c_str());
+    if (bval == 0 || persist == "0")
+        return args;
+    if (bval > 0)
+        persist = "60";
+    // Only for OpenSSH, and only if the user isn't doing this already.
+    const char *base = strrchr(ssh_args[0], '/');
+    if (strcmp(base ? base + 1 : ssh_args[0], "ssh") != 0)
+        return args;
+    for (int i = 1; ssh_args[i]; i++) {
+        if (strcmp(ssh_args[i], "-S") == 0
+            || strstr(ssh_args[i], "Control") != NULL)
+            return args;
+    }
+    // %C is a hash of the connection parameters; this must fit in a
+    // Unix domain socket name.
+    std::string path = std::string(domterm_socket_dir()) + "/ssh-%C";
+    if (path.length() + 40 > 100)
+        return args;
+    args.push_back("-o");
+    args.push_back("ControlMaster=auto");
+    args.push_back("-o");
+    args.push_back("ControlPath=" + path);
+    args.push_back("-o");
+    args.push_back("ControlPersist=" + persist);
+    return args;
+}
+
 struct pty_client *
 handle_remote(int argc, arglist_t argv, struct options *opts, struct tty_client *tclient)
 {
@@ -2794,8 +3553,9 @@ handle_remote(int argc, arglist_t argv, struct options *opts, struct tty_client
     } else {
         host_spec = strdup(host_arg);
     }
-    std::string ssh_cmd = get_setting_s(opts->settings, "command.ssh");
-    char *ssh_expanded = expand_host_conditional(ssh_cmd.c_str(), host_spec);
+    const settings_snapshot& settings = opts->current_settings();
+    char *ssh_expanded =
+        expand_host_conditional(settings.command_ssh.get(), host_spec);
     static const char *ssh_default = "ssh";
     if (ssh_expanded == NULL)
         ssh_expanded = strdup(ssh_default);
@@ -2808,19 +3568,24 @@ handle_remote(int argc, arglist_t argv, struct options *opts, struct tty_client
         free((void*)ssh_args);
         return NULL;
     }
-    std::string domterm_cmd = get_setting_s(opts->settings, "command.remote-domterm");
-    char *dt_expanded = expand_host_conditional(domterm_cmd.c_str(), host_spec);
+    char *dt_expanded =
+        expand_host_conditional(settings.command_remote_domterm.get(),
+                                host_spec);
     if (dt_expanded == NULL)
         dt_expanded = strdup("domterm");
     argblob_t domterm_args = parse_args(dt_expanded, false);
     int domterm_argc = count_args(domterm_args);
     free(dt_expanded);
 
-    int max_rargc = argc+ssh_argc+domterm_argc+8;
+    std::vector<std::string> mux_args = ssh_multiplex_args(opts, ssh_args);
+
+    int max_rargc = argc+ssh_argc+mux_args.size()+domterm_argc+8;
     const char** rargv = (const char**) xmalloc(sizeof(char*)*(max_rargc+1));
         int rargc = 0;
         for (int i = 0; i < ssh_argc; i++)
             rargv[rargc++] = ssh_args[i];
+        for (auto& arg : mux_args)
+            rargv[rargc++] = arg.c_str();
         rargv[rargc++] = host_url;
         for (int i = 0; i < domterm_argc; i++)
             rargv[rargc++] = domterm_args[i];
@@ -2876,6 +3641,8 @@ handle_remote(int argc, arglist_t argv, struct options *opts, struct tty_client
         }
 #endif
         pclient->is_ssh_pclient = true;
+        pclient->remote_timer.callback = remote_output_timed_out;
+        pclient->remote_timer.data = pclient;
         pclient->preserve_mode = 0;
         char tbuf[20];
         snprintf(tbuf, sizeof(tbuf), "%d", pclient->session_number);
@@ -2936,9 +3703,205 @@ handle_command(int argc, arglist_t argv, struct options *opts)
 
 }
 
+/* Fair scheduling of pty reads.
+ *
+ * Without a limit, a session producing output as fast as it can (say one
+ * running 'yes') reads as much as fits in its clients' output buffers
+ * each time its pty is ready, and gets most of the loop time and socket
+ * bandwidth - making other sessions sluggish.
+ *
+ * Instead, we use deficit round-robin: each iteration of the main loop
+ * is a round, in which a session may read up to its sched_deficit.
+ * The deficit is topped up by a quantum each round, and is reset once
+ * the session's pty has been drained.  Sessions with recent user input
+ * get a bigger quantum, so interactive sessions stay responsive while
+ * a neighbor floods.  The budget only applies when more than one session
+ * produced output in the previous round, so a lone busy session
+ * runs at full speed.
+ */
+#define SCHED_QUANTUM 8192
+#define SCHED_INTERACTIVE_WEIGHT 4
+#define SCHED_INTERACTIVE_USEC 2000000 /* input within 2 seconds */
+
+static long sched_round = 0;
+static int sched_readers = 0; // sessions that read in this round
+static int sched_prev_readers = 0; // sessions that read in previous round
+
+/** Called by the main loop before each lws_service. */
+void
+sched_next_round()
+{
+    sched_round++;
+    sched_prev_readers = sched_readers;
+    sched_readers = 0;
+}
+
+// How much pclient may read now, given avail space.
+static size_t
+sched_budget(struct pty_client *pclient, size_t avail)
+{
+    if (pclient->sched_round != sched_round) {
+        long quantum = SCHED_QUANTUM;
+        if (pclient->last_input_us != 0
+            && monotonic_usec() - pclient->last_input_us
+            < SCHED_INTERACTIVE_USEC)
+            quantum *= SCHED_INTERACTIVE_WEIGHT;
+        if (pclient->sched_deficit > quantum)
+            pclient->sched_deficit = quantum;
+        pclient->sched_deficit += quantum;
+        pclient->sched_round = sched_round;
+        sched_readers++;
+    }
+    if (sched_prev_readers <= 1 || pclient->sched_deficit >= (long) avail)
+        return avail;
+    return pclient->sched_deficit > 0 ? pclient->sched_deficit : 0;
+}
+
+static void
+sched_charge(struct pty_client *pclient, long nread, size_t requested)
+{
+    if (nread < (long) requested)
+        pclient->sched_deficit = 0; // drained
+    else
+        pclient->sched_deficit -= nread;
+}
+
+#if USE_PTY_PACKET_MODE && TIOCPKT_IOCTL
+/* After a TIOCPKT_IOCTL packet: update cached_termios, and append
+ * the (urgent) message telling the frontend about the termios state. */
+static void
+termios_report(struct pty_client *pclient, int fd_in, sbuf& sb)
+{
+    struct termios tio;
+    tcgetattr(fd_in, &tio);
+    // Changes are only reported while EXTPROC
+    // is set, so only then can we trust tio.
+    pclient->cached_termios = tio;
+    pclient->termios_cached =
+#if EXTPROC
+        (tio.c_lflag & EXTPROC) != 0;
+#else
+        false;
+#endif
+    const char* icanon_str = (tio.c_lflag & ICANON) != 0 ? "icanon" :  "-icanon";
+    const char* echo_str = (tio.c_lflag & ECHO) != 0 ? "echo" :  "-echo";
+    sb.printf(URGENT_START_STRING "\033]71; %s %s", icanon_str, echo_str);
+#if EXTPROC
+    if ((tio.c_lflag & EXTPROC) != 0)
+        sb.append(" extproc");
+#endif
+    if ((tio.c_lflag & ISIG) != 0) {
+        int v = tio.c_cc[VINTR];
+        if (v != _POSIX_VDISABLE)
+            sb.printf(" intr=%d", v);
+        v = tio.c_cc[VEOF];
+        if (v != _POSIX_VDISABLE)
+            sb.printf(" eof=%d", v);
+        v = tio.c_cc[VSUSP];
+        if (v != _POSIX_VDISABLE)
+            sb.printf(" susp=%d", v);
+        v = tio.c_cc[VQUIT];
+        if (v != _POSIX_VDISABLE)
+            sb.printf(" quit=%d", v);
+    }
+    sb.printf(" lflag:%lx\007" URGENT_END_STRING,
+              (unsigned long) tio.c_lflag);
+}
+
+/** Handle a TIOCPKT_IOCTL packet read by someone other than
+ * handle_process_output (namely governor_discard). */
+void
+pclient_report_termios(struct pty_client *pclient, int fd_in)
+{
+    sbuf sb;
+    termios_report(pclient, fd_in, sb);
+    FOREACH_WSCLIENT(tclient, pclient) {
+        if (! tclient->out_wsi)
+            continue;
+        // Not process output, so not counted in ocount.
+        tclient->ob.append(sb);
+        lws_callback_on_writable(tclient->out_wsi);
+    }
+}
+#endif
+
+// Most we read at once from a session with no windows.
+#define DETACHED_READ_MAX 16384
+
+/* Read output of a session that has no windows, but whose output is
+ * still wanted by a pending 'await -s' or 'tail -f' request.  There is no
+ * tclient->ob to read into, and no window to wait for, so we read
+ * into a scratch buffer rather than pausing the session. */
+static int
+read_detached_output(struct pty_client *pclient, int fd_in)
+{
+    sbuf ob;
+    ob.extend(DETACHED_READ_MAX);
+    ssize_t n = read(fd_in, ob.buffer, DETACHED_READ_MAX);
+    dtlog(LLL_INFO, "RAW_RX pty %ld session %ld read %ld (detached)\n",
+          (long) fd_in, (long) pclient->session_number, (long) n);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+        return -1;
+    if (n < 0)
+        return 0;
+    char *data = ob.buffer;
+    if (pclient->uses_packet_mode) {
+#if USE_PTY_PACKET_MODE
+        if (data[0] != TIOCPKT_DATA) {
+#if TIOCPKT_IOCTL
+            if (n == 1 && (data[0] & TIOCPKT_IOCTL) != 0)
+                pclient_report_termios(pclient, fd_in);
+#endif
+            return 0;
+        }
+        data++;
+        n--;
+#endif
+    } else if (pclient->proxy_inflate) {
+        n = proxy_inflate_output(pclient, ob, n);
+        if (n < 0)
+            return -1;
+        data = ob.avail_start();
+    }
+    trace_bytes(n);
+    if (should_backup_output(pclient))
+        backup_output(pclient, data, n);
+    if (pclient->output_scanner && n > 0)
+        scan_process_output(pclient, data, n);
+    // A tap never pauses the session; it drops what doesn't fit.
+    if (pclient->output_taps && n > 0)
+        tap_process_output(pclient, data, n);
+    pclient->last_output_us = monotonic_usec();
+    governor_count(pclient, n);
+    return 0;
+}
+
+/** Resume reading a session that was paused for lack of windows,
+ * because an 'await -s' or 'tail -f' request now wants its output. */
+void
+pclient_resume_detached(struct pty_client *pclient)
+{
+    if (! pclient->paused)
+        return;
+    FOREACH_WSCLIENT(tclient, pclient) {
+        if (tclient->out_wsi)
+            return; // paused by flow control of a window
+    }
+#if USE_RXFLOW
+    lwsl_info("session %d unpaused (no windows)\n",
+              pclient->session_number);
+    lws_rx_flow_control(pclient->pty_wsi,
+                        1|LWS_RXFLOW_REASON_FLAG_PROCESS_NOW);
+#endif
+    pclient->paused = 0;
+    watch_notify("unpaused", pclient, NULL);
+}
+
 int
 handle_process_output(struct lws *wsi, struct pty_client *pclient,
                       int fd_in, struct stderr_client *stderr_client) {
+            if (pclient->output_collapsed && stderr_client == NULL)
+                return governor_discard(pclient, fd_in);
             long min_unconfirmed = LONG_MAX;
             size_t avail = INT_MAX;
             int tclients_seen = 0;
@@ -2959,9 +3922,15 @@ handle_process_output(struct lws *wsi, struct pty_client *pclient,
                     tclient->ob.extend(5000);
                     tavail = tclient->ob.size - tclient->ob.len;
                 }
+                // Output to a proxy is backed up (see proxy_write).
+                if (tclient->proxy_pending.data_length() >= MAX_PROXY_PENDING)
+                    tavail = 0;
                 if (tavail < avail)
                     avail = tavail;
             }
+            if (tclients_seen == 0 && stderr_client == NULL
+                && (pclient->output_scanner || pclient->output_taps))
+                return read_detached_output(pclient, fd_in);
             if (min_unconfirmed >= MAX_UNCONFIRMED || avail == 0
                 || pclient->paused) {
                 if (! pclient->paused) {
@@ -2977,12 +3946,16 @@ handle_process_output(struct lws *wsi, struct pty_client *pclient,
                     lws_rx_flow_control(wsi, 0|LWS_RXFLOW_REASON_FLAG_PROCESS_NOW);
 #endif
                     pclient->paused = 1;
+                    watch_notify("paused", pclient, NULL);
                 }
                 return 0;
             }
+            if (stderr_client == NULL)
+                avail = sched_budget(pclient, avail);
             if (avail >= eof_len) {
                 char *data_start = NULL;
                 int data_length = 0, read_length = 0;
+                bool control_packet = false; // packet-mode status, no data
                 FOREACH_WSCLIENT(tclient, pclient) {
                     if (! tclient->out_wsi)
                         continue;
@@ -2991,47 +3964,23 @@ handle_process_output(struct lws *wsi, struct pty_client *pclient,
                         ssize_t n;
                         if (pclient->uses_packet_mode) {
 #if USE_PTY_PACKET_MODE
-                            // We know data_start > obuffer_raw, so
+                            // Since ob has headroom,
                             // it's safe to access data_start[-1].
                             char save_byte = data_start[-1];
                             n = read(fd_in, data_start-1, avail+1);
-                            lwsl_info("RAW_RX pty %d session %d read %ld avail %ld tclient#%d\n",
-                                      fd_in, pclient->session_number, (long) n, (long) avail, tclient->connection_number);
+                            dtlog(LLL_INFO, "RAW_RX pty %ld session %ld read %ld avail %ld tclient#%ld\n",
+                                  (long) fd_in, (long) pclient->session_number,
+                                  (long) n, (long) avail,
+                                  (long) tclient->connection_number);
                             if (n == 0)
                                 return -1;
                             char pcmd = data_start[-1];
                             data_start[-1] = save_byte;
+                            control_packet = n > 0 && pcmd != TIOCPKT_DATA;
 #if TIOCPKT_IOCTL
                             if (n == 1 && (pcmd & TIOCPKT_IOCTL) != 0) {
-                                struct termios tio;
-                                tcgetattr(fd_in, &tio);
-                                const char* icanon_str = (tio.c_lflag & ICANON) != 0 ? "icanon" :  "-icanon";
-                                const char* echo_str = (tio.c_lflag & ECHO) != 0 ? "echo" :  "-echo";
                                 int data_old_length = tclient->ob.len;
-                                tclient->ob.printf(
-                                    URGENT_START_STRING "\033]71; %s %s",
-                                    icanon_str, echo_str);
-#if EXTPROC
-                                if ((tio.c_lflag & EXTPROC) != 0)
-                                    tclient->ob.append(" extproc");
-#endif
-                                if ((tio.c_lflag & ISIG) != 0) {
-                                    int v = tio.c_cc[VINTR];
-                                    if (v != _POSIX_VDISABLE)
-                                        tclient->ob.printf(" intr=%d", v);
-                                    v = tio.c_cc[VEOF];
-                                    if (v != _POSIX_VDISABLE)
-                                        tclient->ob.printf(" eof=%d", v);
-                                    v = tio.c_cc[VSUSP];
-                                    if (v != _POSIX_VDISABLE)
-                                        tclient->ob.printf(" susp=%d", v);
-                                    v = tio.c_cc[VQUIT];
-                                    if (v != _POSIX_VDISABLE)
-                                        tclient->ob.printf(" quit=%d", v);
-                                }
-                                tclient->ob.printf(
-                                    " lflag:%lx\007" URGENT_END_STRING,
-                                    (unsigned long) tio.c_lflag);
+                                termios_report(pclient, fd_in, tclient->ob);
                                 data_start = tclient->ob.buffer+data_old_length;
                                 n = tclient->ob.len - data_old_length;
                                 data_length = n;
@@ -3043,15 +3992,25 @@ handle_process_output(struct lws *wsi, struct pty_client *pclient,
 #endif
                         } else {
                             n = read(fd_in, data_start, avail);
-                            lwsl_info("RAW_RX pty %d session %d read %ld tclient#%d\n",
-                                      fd_in, pclient->session_number,
-                                      (long) n, tclient->connection_number);
+                            dtlog(LLL_INFO, "RAW_RX pty %ld session %ld read %ld tclient#%ld\n",
+                                  (long) fd_in, (long) pclient->session_number,
+                                  (long) n, (long) tclient->connection_number);
                             if (n == 0)
                                 return -1;
+                            if (n > 0 && pclient->proxy_inflate
+                                && stderr_client == NULL) {
+                                n = proxy_inflate_output(pclient,
+                                                         tclient->ob, n);
+                                if (n < 0)
+                                    return -1;
+                                data_start = tclient->ob.avail_start();
+                            }
                             read_length = n;
                         }
                         data_length += read_length;
                     } else {
+                        // Decompressed output may be more than avail.
+                        tclient->ob.extend(data_length);
                         memcpy(tclient->ob.buffer+tclient->ob.len,
                                data_start, data_length);
                     }
@@ -3059,9 +4018,23 @@ handle_process_output(struct lws *wsi, struct pty_client *pclient,
                     tclient->ocount += read_length;
                     lws_callback_on_writable(tclient->out_wsi);
                 }
+                trace_bytes(read_length);
+                // A control packet says nothing about whether the pty
+                // is drained, so leave the deficit alone.
+                if (stderr_client == NULL && data_start != NULL
+                    && ! control_packet)
+                    sched_charge(pclient, read_length, avail);
                 if (should_backup_output(pclient)) {
                     backup_output(pclient, data_start, read_length);
                 }
+                if (pclient->output_scanner && read_length > 0)
+                    scan_process_output(pclient, data_start, read_length);
+                if (pclient->output_taps && read_length > 0)
+                    tap_process_output(pclient, data_start, read_length);
+                if (stderr_client == NULL) {
+                    pclient->last_output_us = monotonic_usec();
+                    governor_count(pclient, read_length);
+                }
             }
             return 0;
 }
@@ -3070,6 +4043,9 @@ int
 callback_pty(struct lws *wsi, enum lws_callback_reasons reason,
              void *user, void *in, size_t len) {
     struct pty_client *pclient = (struct pty_client *) user;
+    callback_scope scope("pty", reason, len);
+    if (pclient)
+        scope.session = pclient->session_number;
     switch (reason) {
     case LWS_CALLBACK_RAW_RX_FILE: {
             lwsl_info("callback_pty LWS_CALLBACK_RAW_RX_FILE wsi:%p len:%zu\n",
@@ -3078,22 +4054,12 @@ callback_pty(struct lws *wsi, enum lws_callback_reasons reason,
             if (pclient->is_ssh_pclient
                 && tclient && tclient->options
                 && tclient->options->remote_output_timeout) {
-                lws_set_timer_usecs(wsi,
-                                    tclient->options->remote_output_timeout
-                                    * (LWS_USEC_PER_SEC / 1000));
+                wheel_timer_arm(&pclient->remote_timer,
+                                tclient->options->remote_output_timeout
+                                * (LWS_USEC_PER_SEC / 1000));
             }
             return handle_process_output(wsi, pclient, pclient->pty, NULL);
     }
-    case LWS_CALLBACK_TIMER:
-            // If we're the local (client) end of ssh.
-            lwsl_notice("callback_pty LWS_CALLBACK_TIMER\n");
-            if (pclient->is_ssh_pclient) {
-                pclient->timed_out = true;
-                //pclient_close(pclient, true);
-                //break;
-                return -1;
-            }
-            break;
         case LWS_CALLBACK_RAW_CLOSE_FILE: {
             lwsl_notice("callback_pty LWS_CALLBACK_RAW_CLOSE_FILE\n");
             pclient_close(pclient, false);
@@ -3111,6 +4077,7 @@ extern int
 callback_ssh_stderr(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len)
 {
     struct stderr_client *sclient = (struct stderr_client *) user;
+    callback_scope scope("ssh_stderr", reason, len);
     switch (reason) {
     case LWS_CALLBACK_RAW_RX_FILE: {
         struct pty_client *pclient = sclient->pclient;
@@ -0,0 +1,411 @@
+/* Compression of the output sent over an ssh connection.
+ *
+ * For a remote session, output from the remote session (and messages
+ * from the remote server) are sent by the remote domterm (proxy_remote)
+ * over the ssh connection to the local domterm (proxy_command_local,
+ * later proxy_display_local).  That is mostly terminal output, which
+ * compresses well.  We don't rely on 'ssh -C', which compresses
+ * everything (including the short input events) at a fixed level.
+ *
+ * Negotiation:
+ * 1. The remote announces it can compress in its first message:
+ *    "\xFDREMOTE-WINDOW compress=deflate\n".  (Older local servers
+ *    ignore the data of the REMOTE-WINDOW message.)
+ * 2. If the remote-compress setting allows it, the local server writes
+ *    a "\xFDPROXY-COMPRESS deflate[ level=N]\n" event to the ssh input,
+ *    and starts looking for PROXY_COMPRESS_MARKER in the ssh output.
+ * 3. The remote server (in reportEvent) sends PROXY_COMPRESS_MARKER,
+ *    followed by a zlib stream containing all further output.
+ * Input (from the local end) is not compressed: it is mostly small
+ * keyboard events, for which compression would just add latency.
+ *
+ * Each session has its own zlib stream, so earlier output of the session
+ * is in effect its dictionary.  Both ends start the stream with the same
+ * preset dictionary of common escape sequences, so even the first
+ * (short) messages compress.  (Changing proxy_dictionary requires a new
+ * name instead of "deflate" in the negotiation.)
+ *
+ * The remote ends each write (the output collected since the connection
+ * was last writable) with Z_SYNC_FLUSH, so everything written so far can
+ * be decompressed at once.  That includes urgent messages and echo of
+ * the user's typing, which therefore are not delayed.  Bulk output gets
+ * batched in larger writes, so the flushes don't cost much.
+ *
+ * Unless the level is fixed by the remote-compress setting, the level is
+ * adapted every PROXY_ADAPT_USEC, depending on whether the link or the
+ * compression is the bottleneck.  If output was held back because the
+ * link didn't keep up (the session was paused by flow control, or a
+ * write was short), and compressing took little time, compress harder.
+ * If compressing takes much of the time, or the link keeps up,
+ * move back towards the fast PROXY_LEVEL_DEFAULT.
+ */
+
+#include "server.h"
+#include <zlib.h>
+
+#define PROXY_COMPRESS_MARKER "\xFDPROXY-COMPRESS\n"
+#define PROXY_COMPRESS_MARKER_LENGTH (sizeof(PROXY_COMPRESS_MARKER) - 1)
+#define PROXY_INFLATE_CHUNK 16384
+#define PROXY_ADAPT_USEC 1000000
+#define PROXY_LEVEL_DEFAULT Z_BEST_SPEED
+#define PROXY_LEVEL_MAX 9
+
+// Sequences common in DomTerm output, most common last.
+static const char proxy_dictionary[] =
+    "\033[?1049h\033[?1049l\033[?2004h\033[?2004l\033[?25l\033[?25h"
+    "\033[?1h\033=\033[?1l\033>\033[H\033[2J\033[J\033[1;1H\033[39;49m"
+    "\033]0;\007\033]2;\007\033]72;<span>\007\033]133;A\007\033]133;B\007"
+    "\033]133;C\007\033]133;D\007\033[01;32m\033[01;34m\033[01;36m"
+    "\033[1m\033[7m\033[31m\033[32m\033[33m\033[34m\033[36m\033[39m"
+    URGENT_START_STRING "\033[96;" URGENT_END_STRING
+    OUT_OF_BAND_START_STRING "\027\033[8;"
+    "\033[0m\033[m\033[K\r\n";
+
+// Remote (compressing) end, for a proxy_remote tty_client.
+struct proxy_deflate {
+    z_stream strm;
+    sbuf out; // compressed data to write
+    bool marker_sent;
+    int level;
+    bool fixed_level; // level from the remote-compress setting
+    long window_start_us;
+    long window_out; // compressed bytes written in this window
+    long window_deflate_us; // time spent compressing in this window
+    bool window_congested;
+    long link_rate; // compressed bytes/second, when congested
+    long total_in;
+    long total_out;
+};
+
+// Local (decompressing) end, for an ssh pty_client.
+struct proxy_inflate {
+    z_stream strm;
+    sbuf in; // read but not yet processed
+    bool streaming; // seen PROXY_COMPRESS_MARKER
+    long total_in;
+    long total_out;
+};
+
+/** Should we ask the remote to compress?
+ * Returns the level to request, 0 if adaptive, or -1 if no compression. */
+static int
+proxy_compress_level(struct options *options)
+{
+    std::string val = options->current_settings().remote_compress.get("auto");
+    if (val == "auto")
+        return 0;
+    int bval = bool_value(val.c_str());
+    if (bval >= 0)
+        return bval ? 0 : -1;
+    char *end;
+    long level = strtol(val.c_str(), &end, 10);
+    if (*end != '\0' || level < 0 || level > PROXY_LEVEL_MAX) {
+        lwsl_warn("bad remote-compress setting '%s'\n", val.c_str());
+        return 0;
+    }
+    return level == 0 ? -1 : (int) level;
+}
+
+/** Local end: the remote sent REMOTE-WINDOW with the given data.
+ * Ask it to compress output, if it can and we want it to. */
+void
+proxy_compress_request(struct pty_client *pclient, struct options *options,
+                       const char *data, size_t dlen)
+{
+    static const char capability[] = "compress=deflate";
+    size_t clen = sizeof(capability) - 1;
+    bool supported = false;
+    for (const char *p = data; p + clen <= data + dlen; p++) {
+        if (memcmp(p, capability, clen) == 0
+            && (p == data || p[-1] == ' ')
+            && (p + clen == data + dlen || p[clen] == ' '
+                || p[clen] == '\n')) {
+            supported = true;
+            break;
+        }
+    }
+    int level = options == NULL ? -1 : proxy_compress_level(options);
+    if (! supported || level < 0 || pclient->proxy_inflate != NULL)
+        return;
+    struct proxy_inflate *z = new proxy_inflate();
+    memset(&z->strm, 0, sizeof(z->strm));
+    if (inflateInit(&z->strm) != Z_OK) {
+        delete z;
+        return;
+    }
+    z->streaming = false;
+    z->total_in = 0;
+    z->total_out = 0;
+    // The zlib stream is binary, so the pty must not translate output.
+    struct termios termios;
+    if (tcgetattr(pclient->pty, &termios) == 0) {
+        termios.c_oflag &= ~OPOST;
+        tcsetattr(pclient->pty, TCSANOW, &termios);
+    }
+    sbuf sb;
+    sb.printf("\xFDPROXY-COMPRESS deflate");
+    if (level > 0)
+        sb.printf(" level=%d", level);
+    sb.append("\n");
+    if (write(pclient->pty, sb.buffer, sb.len) != (ssize_t) sb.len) {
+        lwsl_err("write PROXY-COMPRESS to ssh failed\n");
+        inflateEnd(&z->strm);
+        delete z;
+        return;
+    }
+    pclient->proxy_inflate = z;
+    lwsl_notice("session %d: requested compression from remote (level %d)\n",
+                pclient->session_number, level);
+}
+
+// How many bytes at the end of buf may be the start of the marker.
+static size_t
+marker_prefix_at_end(const char *buf, size_t len)
+{
+    size_t k = PROXY_COMPRESS_MARKER_LENGTH - 1;
+    if (k > len)
+        k = len;
+    for (; k > 0; k--) {
+        if (memcmp(buf + len - k, PROXY_COMPRESS_MARKER, k) == 0)
+            return k;
+    }
+    return 0;
+}
+
+/** Local end: n bytes were read from the ssh pty to ob.avail_start().
+ * Replace them by the decompressed data (if any).
+ * Returns the new number of bytes at ob.avail_start(), or -1 on error.
+ * (ob.len is not changed; as with read, the caller adds the result.) */
+ssize_t
+proxy_inflate_output(struct pty_client *pclient, sbuf& ob, size_t n)
+{
+    struct proxy_inflate *z = pclient->proxy_inflate;
+    sbuf& in = z->in;
+    in.append(ob.avail_start(), n);
+    size_t olen = ob.len;
+    size_t done = 0;
+    if (! z->streaming) {
+        // Output before the marker is not compressed.
+        const char *m = (const char *)
+            memmem(in.buffer, in.len,
+                   PROXY_COMPRESS_MARKER, PROXY_COMPRESS_MARKER_LENGTH);
+        done = m ? m - in.buffer
+            : in.len - marker_prefix_at_end(in.buffer, in.len);
+        ob.append(in.buffer, done);
+        if (m) {
+            done += PROXY_COMPRESS_MARKER_LENGTH;
+            z->streaming = true;
+            lwsl_notice("session %d: output from remote is compressed\n",
+                        pclient->session_number);
+        }
+    }
+    if (z->streaming && done < in.len) {
+        z->strm.next_in = (Bytef *) in.buffer + done;
+        z->strm.avail_in = in.len - done;
+        z->total_in += in.len - done;
+        size_t before = ob.len;
+        for (;;) {
+            ob.extend(PROXY_INFLATE_CHUNK);
+            z->strm.next_out = (Bytef *) ob.avail_start();
+            z->strm.avail_out = ob.avail_space();
+            int r = inflate(&z->strm, Z_NO_FLUSH);
+            if (r == Z_NEED_DICT)
+                r = inflateSetDictionary(&z->strm,
+                                         (const Bytef *) proxy_dictionary,
+                                         sizeof(proxy_dictionary) - 1);
+            ob.len = ob.size - z->strm.avail_out;
+            if (r != Z_OK && r != Z_BUF_ERROR) {
+                lwsl_err("session %d: bad compressed data from remote (%d)\n",
+                         pclient->session_number, r);
+                ob.len = olen;
+                return -1;
+            }
+            if (r == Z_BUF_ERROR
+                || (z->strm.avail_in == 0 && z->strm.avail_out > 0))
+                break;
+        }
+        z->total_out += ob.len - before;
+        done = in.len;
+    }
+    in.erase(0, done);
+    ssize_t result = ob.len - olen;
+    ob.len = olen;
+    return result;
+}
+
+/** Remote end: the local end sent PROXY-COMPRESS with the given data. */
+void
+proxy_deflate_start(struct tty_client *tclient, const char *data)
+{
+    if (tclient->proxy_deflate != NULL
+        || strncmp(data, "deflate", 7) != 0)
+        return;
+    int level = 0;
+    const char *lv = strstr(data, "level=");
+    if (lv)
+        level = atoi(lv + 6);
+    struct proxy_deflate *z = new proxy_deflate();
+    z->fixed_level = level > 0 && level <= PROXY_LEVEL_MAX;
+    z->level = z->fixed_level ? level : PROXY_LEVEL_DEFAULT;
+    memset(&z->strm, 0, sizeof(z->strm));
+    if (deflateInit(&z->strm, z->level) != Z_OK
+        || deflateSetDictionary(&z->strm, (const Bytef *) proxy_dictionary,
+                                sizeof(proxy_dictionary) - 1) != Z_OK) {
+        deflateEnd(&z->strm);
+        delete z;
+        return;
+    }
+    z->marker_sent = false;
+    z->window_start_us = monotonic_usec();
+    z->window_out = 0;
+    z->window_deflate_us = 0;
+    z->window_congested = false;
+    z->link_rate = 0;
+    z->total_in = 0;
+    z->total_out = 0;
+    tclient->proxy_deflate = z;
+    lwsl_notice("conn#%d: compressing output (level %d%s)\n",
+                tclient->connection_number, z->level,
+                z->fixed_level ? "" : ", adaptive");
+    // Send the marker, even if there is no output.
+    lws_callback_on_writable(tclient->out_wsi);
+}
+
+static void
+proxy_deflate_adapt(struct tty_client *tclient, long now, sbuf& zout)
+{
+    struct proxy_deflate *z = tclient->proxy_deflate;
+    long elapsed = now - z->window_start_us;
+    if (elapsed < PROXY_ADAPT_USEC)
+        return;
+    double cpu = (double) z->window_deflate_us / elapsed;
+    if (z->window_congested)
+        z->link_rate = (long) (z->window_out * 1000000.0 / elapsed);
+    int level = z->level;
+    if (z->window_congested && cpu < 0.2)
+        level++;
+    else if (cpu > 0.4 || ! z->window_congested)
+        level--;
+    if (level > PROXY_LEVEL_MAX)
+        level = PROXY_LEVEL_MAX;
+    if (level < PROXY_LEVEL_DEFAULT)
+        level = PROXY_LEVEL_DEFAULT;
+    // Everything so far was flushed, so deflateParams should have
+    // (almost) nothing to write, but it needs some output space.
+    if (level != z->level) {
+        zout.extend(64);
+        z->strm.next_out = (Bytef *) zout.avail_start();
+        z->strm.avail_out = zout.avail_space();
+        int r = deflateParams(&z->strm, level, Z_DEFAULT_STRATEGY);
+        zout.len = zout.size - z->strm.avail_out;
+        if (r == Z_OK)
+            z->level = level;
+        lwsl_info("conn#%d: compression level %d (link %ld bytes/s, cpu %.0f%%)\n",
+                  tclient->connection_number, level, z->link_rate,
+                  cpu * 100);
+    }
+    z->window_start_us = now;
+    z->window_out = 0;
+    z->window_deflate_us = 0;
+    z->window_congested = false;
+}
+
+/** Remote end: compress data to be written to the local end.
+ * Sets *out and *out_len to the data to write instead.
+ * Returns false on failure. */
+bool
+proxy_deflate_output(struct tty_client *tclient, char **out, size_t *out_len)
+{
+    struct proxy_deflate *z = tclient->proxy_deflate;
+    long start = monotonic_usec();
+    sbuf& zout = z->out;
+    zout.len = 0;
+    if (! z->marker_sent) {
+        zout.append(PROXY_COMPRESS_MARKER, PROXY_COMPRESS_MARKER_LENGTH);
+        z->marker_sent = true;
+    }
+    if (! z->fixed_level)
+        proxy_deflate_adapt(tclient, start, zout);
+    if (*out_len > 0) {
+        z->strm.next_in = (Bytef *) *out;
+        z->strm.avail_in = *out_len;
+        do {
+            zout.extend(deflateBound(&z->strm, z->strm.avail_in) + 16);
+            z->strm.next_out = (Bytef *) zout.avail_start();
+            z->strm.avail_out = zout.avail_space();
+            if (deflate(&z->strm, Z_SYNC_FLUSH) == Z_STREAM_ERROR)
+                return false;
+            zout.len = zout.size - z->strm.avail_out;
+        } while (z->strm.avail_out == 0);
+        z->total_in += *out_len;
+    }
+    z->total_out += zout.len;
+    z->window_out += zout.len;
+    z->window_deflate_us += monotonic_usec() - start;
+    if (tclient->pclient && tclient->pclient->paused)
+        z->window_congested = true;
+    *out = zout.buffer;
+    *out_len = zout.len;
+    return true;
+}
+
+/** Remote end: note that a write of compressed data was short. */
+void
+proxy_deflate_congested(struct tty_client *tclient)
+{
+    if (tclient->proxy_deflate)
+        tclient->proxy_deflate->window_congested = true;
+}
+
+void
+proxy_deflate_close(struct tty_client *tclient)
+{
+    struct proxy_deflate *z = tclient->proxy_deflate;
+    if (z == NULL)
+        return;
+    deflateEnd(&z->strm);
+    delete z;
+    tclient->proxy_deflate = NULL;
+}
+
+void
+proxy_inflate_close(struct pty_client *pclient)
+{
+    struct proxy_inflate *z = pclient->proxy_inflate;
+    if (z == NULL)
+        return;
+    inflateEnd(&z->strm);
+    delete z;
+    pclient->proxy_inflate = NULL;
+}
+
+static void
+print_ratio(FILE *out, long compressed, long uncompressed)
+{
+    if (uncompressed > 0)
+        fprintf(out, ", compressed to %ld%%",
+                (compressed * 100 + uncompressed / 2) / uncompressed);
+}
+
+/** For 'domterm status': the local end of a remote session. */
+void
+print_proxy_inflate_status(struct pty_client *pclient, FILE *out)
+{
+    struct proxy_inflate *z = pclient->proxy_inflate;
+    if (z != NULL && z->streaming)
+        print_ratio(out, z->total_in, z->total_out);
+}
+
+/** For 'domterm status': the remote end of a connection. */
+void
+print_proxy_deflate_status(struct tty_client *tclient, FILE *out)
+{
+    struct proxy_deflate *z = tclient->proxy_deflate;
+    if (z == NULL)
+        return;
+    print_ratio(out, z->total_out, z->total_in);
+    fprintf(out, " (level %d%s", z->level, z->fixed_level ? "" : ", adaptive");
+    if (z->link_rate > 0)
+        fprintf(out, ", link %ld kB/s", (z->link_rate + 512) >> 10);
+    fprintf(out, ")");
+}
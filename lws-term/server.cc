@@ -12,6 +12,8 @@ extern char **environ;
 
 static struct options opts;
 struct options *main_options = &opts;
+// The options (before the command) the server was started with.
+std::vector<std::string> server_startup_args;
 struct lws *cmdwsi = NULL;
 char *argv0;
 
@@ -20,12 +22,6 @@ char *main_html_prefix;
 static char *make_socket_name(bool);
 
 static FILE *_logfile = NULL;
-static void lwsl_emit_stderr_with_flush(int level, const char * line) {
-    char buf[50];
-    lwsl_timestamp(level, buf, sizeof(buf));
-    fprintf(_logfile, "%s%s", buf, line);
-    fflush(_logfile);
-}
 
 static void
 daemonize()
@@ -50,7 +46,9 @@ maybe_daemonize()
             lwsl_notice("about to switch to background 'daemon' mode\n");
         }
         tty_restore(-1);
+        log_flush();
         daemonize();
+        log_after_daemonize();
         opts.do_daemonize = -1;
     }
 }
@@ -80,13 +78,35 @@ int start_command(struct options *opts, const char *cmd,
         }
     } else {
 #if 1
-        int r = system(cmd);
-        if (! WIFEXITED(r) || (WEXITSTATUS(r) != 0 && ! is_WindowsSubsystemForLinux())) {
-            printf_error(opts, "system could not execute %s (return code: %x)",
-                         cmd, r);
+        // Like system(cmd), but don't block the server while it runs.
+        // If a command client is waiting, it gets the result when
+        // the command is done; otherwise failure is only logged.
+        std::string scmd = cmd;
+        struct options *requester =
+            opts != main_options && opts->fd_cmd_socket >= 0
+            ? link_options(opts) : nullptr;
+        if (! start_subprocess(cmd, false, [scmd, requester](int r, sbuf&) {
+                    bool failed = ! WIFEXITED(r)
+                        || (WEXITSTATUS(r) != 0
+                            && ! is_WindowsSubsystemForLinux());
+                    if (requester) {
+                        if (failed)
+                            printf_error(requester, "system could not execute %s (return code: %x)",
+                                         scmd.c_str(), r);
+                        finish_request(requester,
+                                       failed ? EXIT_FAILURE : EXIT_SUCCESS,
+                                       true);
+                        options::release(requester);
+                    } else if (failed)
+                        lwsl_err("system could not execute %s (return code: %x)\n",
+                                 scmd.c_str(), r);
+                })) {
+            if (requester)
+                options::release(requester);
+            printf_error(opts, "could not execute %s", cmd);
             return EXIT_FAILURE;
         }
-        return EXIT_SUCCESS;
+        return requester ? EXIT_WAIT : EXIT_SUCCESS;
 #else
         char *shell = getenv("SHELL");
         if (shell == NULL)
@@ -141,6 +161,9 @@ int start_command(struct options *opts, const char *cmd,
             cclient->cmd_pid = pid;
             cclient->fd = pipe_fds[0];
             (void)close(pipe_fds[1]);
+        } else {
+            // The child exits right away (after daemonize); reap it.
+            watch_subprocess(pid, nullptr);
         }
     } else {
         printf_error(opts, "could not fork front-end command");
@@ -182,6 +205,20 @@ static const struct lws_protocols protocols[] = {
     // connect to browser application using pipe - only Electron and Wry - deprecated
     {"browser-output", callback_browser_cmd,  sizeof(struct browser_cmd_client),  0},
 
+    /* Command socket of a 'domterm watch' subscriber, after the command
+       has been accepted.  Used to detect when the subscriber goes away. */
+    {"watch",     callback_watch, sizeof(struct watch_client),  0},
+
+    /* Command socket of a pending 'domterm await -s' request. */
+    {"await",     callback_await, sizeof(struct output_await*),  0},
+
+    /* Command socket of a 'domterm tail' request. */
+    {"tail",      callback_tail,  sizeof(struct output_tap*),  0},
+
+    /* SIGCHLD notification pipe, and stdout of helper commands.
+       See subprocess.cc. */
+    {"subprocess", callback_subprocess, sizeof(struct subprocess*),  0},
+
 #if REMOTE_SSH
     /* "proxy" protocol is an alternative to "domterm" in that
        it proxies between a pty_client and a file (or socket?) handle(s):
@@ -846,16 +883,18 @@ main(int argc, char **argv)
     if (logfilefmt == NULL)
         logfilefmt = "/tmp/domterm-%P.log";
     if (debug_level == 0)
-        lws_set_log_level(debug_level, NULL);
-    else if (strcmp(logfilefmt, "stderr") == 0)
-        lws_set_log_level(debug_level, lwsl_emit_stderr);
-    else if (strcmp(logfilefmt, "stdout") == 0) {
+        log_setup(debug_level, NULL, false);
+    else if (strcmp(logfilefmt, "stderr") == 0) {
+        _logfile = stderr;
+        log_setup(debug_level, _logfile, true);
+    } else if (strcmp(logfilefmt, "stdout") == 0) {
         _logfile = stdout;
-        lws_set_log_level(debug_level, lwsl_emit_stderr_with_flush);
+        log_setup(debug_level, _logfile, true);
     } else if (strcmp(logfilefmt, "stderr-notimestamp") == 0
-               || strcmp(logfilefmt, "notimestamp") == 0)
-        lws_set_log_level(debug_level, lwsl_emit_stderr_notimestamp);
-    else {
+               || strcmp(logfilefmt, "notimestamp") == 0) {
+        _logfile = stderr;
+        log_setup(debug_level, _logfile, false);
+    } else {
         struct sbuf sb;
         const char *p = logfilefmt;
         for (; *p; p++) {
@@ -874,7 +913,7 @@ main(int argc, char **argv)
         }
         sb.append("", 1);
         _logfile = fopen((const char *) sb.buffer, "a");
-        lws_set_log_level(debug_level, lwsl_emit_stderr_with_flush);
+        log_setup(debug_level, _logfile, true);
     }
 
     lwsl_notice("domterm terminal server %s (git describe: %s)\n",
@@ -895,11 +934,15 @@ main(int argc, char **argv)
         return EXIT_BAD_CMDARG;
     if (opts.something_done && argv[optind] == NULL)
         return EXIT_SUCCESS;
+    for (int i = 1; i < optind; i++)
+        server_startup_args.push_back(argv[i]);
 
     signal(SIGINT, sig_handler);  // ^C
     signal(SIGTERM, sig_handler); // kill
 
-    const char *cmd = argv[optind];
+    struct upgrade_info upgrade;
+    bool upgrading = upgrade_state_load(&upgrade);
+    const char *cmd = upgrading ? NULL : argv[optind];
     struct command *command = cmd == NULL ? NULL : find_command(cmd);
     if (command == NULL && cmd != NULL && index(cmd, '/') == NULL
 #if REMOTE_SSH
@@ -914,7 +957,11 @@ main(int argc, char **argv)
         check_domterm(&opts);
     }
     int socket = -1;
-    if ((command == NULL ||
+    if (upgrading) {
+        backend_socket_name = strdup(upgrade.socket_name.c_str());
+        info.port = upgrade.http_port;
+        tserver.client_can_close = upgrade.client_can_close;
+    } else if ((command == NULL ||
          (command->options &
           (COMMAND_IN_CLIENT_IF_NO_SERVER|COMMAND_IN_SERVER)) != 0)) {
         backend_socket_name = make_socket_name(false);
@@ -937,7 +984,7 @@ main(int argc, char **argv)
         exit(client_send_command(socket, argc, argv, environ));
     }
 
-    if (port_specified < 0)
+    if (port_specified < 0 && ! upgrading)
         tserver.client_can_close = true;
 
 #if LWS_LIBRARY_VERSION_MAJOR >= 2
@@ -1008,6 +1055,8 @@ main(int argc, char **argv)
     cclient->socket = csocket.filefd;
     main_html_prefix = make_socket_name(true);
     generate_random_string(server_key, SERVER_KEY_LENGTH);
+    if (upgrading && upgrade.server_key.length() == SERVER_KEY_LENGTH)
+        memcpy(server_key, upgrade.server_key.c_str(), SERVER_KEY_LENGTH);
 
     lwsl_info("TTY configuration:\n");
     if (opts.credential != NULL)
@@ -1024,7 +1073,10 @@ main(int argc, char **argv)
     if (opts.once)
         lwsl_info("  once: true\n");
     int ret;
-    if (port_specified >= 0 && opts.browser_command.empty()) {
+    if (upgrading) {
+        upgrade_restore_sessions();
+        ret = 0;
+    } else if (port_specified >= 0 && opts.browser_command.empty()) {
         fprintf(stderr, "Server start on port %d. You can browse %s://localhost:%d/\n",
                 http_port, opts.ssl ? "https" : "http", http_port);
         opts.http_server = true;
@@ -1040,10 +1092,18 @@ main(int argc, char **argv)
     if (ret == 0)
         maybe_daemonize();
     watch_settings_file();
+    prewarm_fill();
+    stall_settings_update();
+    governor_settings_update();
+    memory_settings_update();
 
     // libwebsockets main loop
     while (!force_exit) {
+        sched_next_round();
+        memory_check();
+        timer_wheel_run();
         lws_service(context, 100);
+        maybe_upgrade_server();
     }
 
     lws_context_destroy(context);
@@ -1321,6 +1381,7 @@ callback_browser_cmd(struct lws *wsi, enum lws_callback_reasons reason,
     struct browser_cmd_client *cclient = (struct browser_cmd_client *) lws_wsi_user(wsi);
     int status = -1;
     lwsl_info("browser_cmd callback %d\n", reason);
+    callback_scope scope("browser_cmd", reason, len);
     switch (reason) {
     case LWS_CALLBACK_RAW_CLOSE_FILE:
         while (waitpid(cclient->cmd_pid, &status, 0) == -1 && errno == EINTR)
@@ -1342,8 +1403,8 @@ callback_browser_cmd(struct lws *wsi, enum lws_callback_reasons reason,
         break;
     }
     case LWS_CALLBACK_RAW_RX_FILE: {
-        struct sbuf &obuf = cclient->output_buffer;
-        obuf.extend(1024);
+        rbuf &obuf = cclient->output_buffer;
+        obuf.reserve(1024);
         ssize_t rcount = read(cclient->fd, obuf.avail_start(), obuf.avail_space());
         if (rcount <= 0) {
             if (rcount == 0)
@@ -1352,14 +1413,13 @@ callback_browser_cmd(struct lws *wsi, enum lws_callback_reasons reason,
             return errno == EAGAIN ? 0 : -1;
         }
         obuf.len += rcount;
-        while (obuf.len > 0) {
-            char *text = obuf.null_terminated();
-            char *newline = strchr(text, '\n');
+        while (obuf.data_length() > 0) {
+            char *cmd = obuf.data();
+            char *newline = (char *) memchr(cmd, '\n', obuf.data_length());
             if (newline == nullptr)
                 break;
-            size_t linelen = newline - obuf.buffer;
+            size_t linelen = newline - cmd;
             *newline = '\0';
-            char *cmd = obuf.buffer;
             if (cmd[0])
                 lwsl_info("browser_cmd received '%s'\n", cmd);
             if (strncmp(cmd, "CLOSE-WINDOW ", 13) == 0) {
@@ -1389,7 +1449,7 @@ callback_browser_cmd(struct lws *wsi, enum lws_callback_reasons reason,
                     open_window("{}", main_options);
                 }
             }
-            obuf.erase(0, linelen+1);
+            obuf.consume(linelen+1);
         }
     }
         break;
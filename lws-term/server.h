@@ -16,8 +16,14 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
 #include <assert.h>
 #include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <functional>
 #include <nlohmann/json.hpp>
 using json = nlohmann::json;
 
@@ -55,6 +61,7 @@ using json = nlohmann::json;
 #include "command-connect.h"
 
 #include "utils.h"
+#include "id-table.h"
 
 #define SERVER_KEY_LENGTH 20
 extern char server_key[SERVER_KEY_LENGTH];
@@ -70,36 +77,15 @@ extern struct lws_vhost *vhost;
 extern char *main_html_prefix;
 extern int port_specified;
 
-// Assume each T has an index()  method that returns a unique positive integer.
-// This table manages the mapping between T and those indexes.
-template<typename T>
-class id_table {
-    // Invariant for elements array
-    // If SNUM is valid then elements[SNUM].index() == SNUM.
-    // Otherwise (if SNUM is < sz): elements[SNUM] points
-    // to nullptr or the next valid element in elements.
-    T** elements = nullptr;
-    int sz = 0;
-public:
-    T* first() { return elements == nullptr ? nullptr : elements[1]; }
-    T* next(T* entry) { return elements[entry->index()+1]; }
-    T*& operator[](int i) { return elements[i]; } // fast/unsafe lookup
-    int enter(T* entry, int hint);
-    void remove(T* entry);
-    bool valid_index(int i) {
-        return i > 0 && i < sz && elements[i] != nullptr
-            && elements[i]->index() == i;
-    }
-    bool avoid_index(int i, int hint);
-    T* operator()(int i) { return valid_index(i) ? elements[i] : nullptr; }
-};
-
 extern int http_port;
 extern struct lws_context_creation_info info; // FIXME rename
 extern struct tty_client *focused_client;
 extern struct cmd_client *cclient;
 extern struct options *main_options;
+extern std::vector<std::string> server_startup_args;
 extern std::string settings_as_json;
+extern std::string settings_delta_as_json;
+extern int64_t settings_counter;
 extern char git_describe[];
 #if REMOTE_SSH
 extern int
@@ -131,6 +117,47 @@ enum option_name {
 #undef OPTION_F
 };
 
+#define OPTION_MISC_TYPE 0
+#define OPTION_NUMBER_TYPE 1
+#define OPTION_STRING_TYPE 2
+
+/** The value of one setting, in a settings_snapshot. */
+template<int TYPE> struct typed_setting {
+    bool is_set = false;
+    std::string value;
+    const char *get(const char *dfault = "") const {
+        return is_set ? value.c_str() : dfault;
+    }
+};
+template<> struct typed_setting<OPTION_NUMBER_TYPE> {
+    bool is_set = false;
+    double value = 0;
+    double get(double dfault) const { return is_set ? value : dfault; }
+};
+
+/** The settings of an options object, compiled (by set_settings)
+ * into a field for each option, so frequent lookups don't need to
+ * search (and copy strings from) the settings json.
+ * A snapshot isn't modified once made: re-reading the settings file
+ * makes a new one, so a holder of the shared_ptr sees a fixed version. */
+struct settings_snapshot {
+    int64_t version = -1; // settings_counter it was compiled from
+#define OPTION_S(NAME, STR, TYPE) typed_setting<TYPE> NAME;
+#define OPTION_F(NAME, STR, TYPE) typed_setting<TYPE> NAME;
+#include "option-names.h"
+#undef OPTION_S
+#undef OPTION_F
+};
+
+/** A timer in the shared timer wheel (see timer-wheel.cc). */
+struct wheel_timer {
+    long deadline_us = 0; // monotonic_usec() when due; 0 if not armed
+    long tick = 0; // wheel tick at which it is checked
+    struct wheel_timer *next = NULL, *prev = NULL; // NULL if not in wheel
+    void (*callback)(struct wheel_timer *) = NULL;
+    void *data = NULL;
+};
+
 /**
  * Data specific to a pty process.
  * This is the user structure for the libwebsockets "pty" protocol.
@@ -153,10 +180,26 @@ public:
     bool uses_packet_mode :1;
     bool use_xtermjs :1;
     bool use_ghostty :1;
+    bool prewarmed :1; // in the shell.prewarm pool, not handed out yet
+    // True if cached_termios is current: in packet mode with EXTPROC set
+    // the kernel tells us (TIOCPKT_IOCTL) whenever the termios change.
+    bool termios_cached :1;
+    bool output_collapsed :1; // see output-governor.cc
+    // Old preserved_output was discarded by memory_check.
+    bool history_evicted :1;
+    // saved_window_contents has been sent to a window, and is only kept
+    // as the base for a WINDOW-CONTENTS-DELTA from that window.
+    bool saved_window_is_base :1;
     bool exit;
     // Number of "pending" re-attach after detach; -1 is allow infinite.
     int detach_count;
     int paused;
+    struct termios cached_termios; // see termios_cached
+    // For fair scheduling of pty reads - see sched_budget in protocol.cc.
+    long sched_deficit; // bytes this session may still read this round
+    long sched_round; // round in which sched_deficit was last topped up
+    long last_input_us; // monotonic_usec() of last input from user
+    long last_output_us; // monotonic_usec() of last output from process
     struct tty_client *first_tclient;
     struct tty_client **last_tclient_ptr;
     struct lws *pty_wsi;
@@ -179,9 +222,23 @@ public:
     // (Should be minumum of saved_window_sent_count (if saved_window_contents)
     // and miniumum of confirmed_count for each tclient.)
 
-    std::string session_name;
+    std::string session_name; // should only be set by set_session_name
+    void set_session_name(const std::string& name);
     const char *cmd;
     argblob_t argv;
+    // Non-NULL while there are pending 'await -s' requests.
+    struct output_scanner *output_scanner;
+    struct output_tap *output_taps; // 'domterm tail --follow' consumers
+    struct output_governor *governor; // non-NULL once output is measured
+    // Non-NULL if saved_window_contents and/or preserved_output have been
+    // compressed (see memory.cc).  Use memory_restore_window or
+    // memory_restore_preserved before accessing them.
+    struct memory_compacted *compacted;
+    // For the local end of an ssh session, if the remote compresses its
+    // output (see proxy-compress.cc).
+    struct proxy_inflate *proxy_inflate;
+    // For the local end of an ssh session: remote-output-timeout.
+    struct wheel_timer remote_timer;
 #if REMOTE_SSH
     // Domain socket to communicate between client and (local) server.
     int cmd_socket;
@@ -190,6 +247,18 @@ public:
 };
 
 extern id_table<pty_client> pty_clients;
+extern name_index<pty_client> sessions_by_name;
+extern void prewarm_fill();
+extern void sched_next_round();
+
+// Skip sessions in the shell.prewarm pool, which are not in use yet.
+inline struct pty_client *
+skip_prewarmed(struct pty_client *pclient)
+{
+    while (pclient != nullptr && pclient->prewarmed)
+        pclient = pty_clients.next(pclient);
+    return pclient;
+}
 
 struct stderr_client {
     struct lws *wsi;
@@ -265,10 +334,14 @@ public:
     bool keep_after_detach : 1;
     bool detach_on_disconnect : 1;
     bool window_name_unique : 1;
+    // Client can handle zlib-compressed snapshots ("snapshot":"deflate"
+    // in VERSION), and sends WINDOW-CONTENTS-DELTA.
+    bool snapshot_deflate : 1;
     bool pty_window_update_needed;
     bool name_update_needed;
     bool detachSaveSend; // need to send a detachSaveNeeded command
     bool uploadSettingsNeeded; // need to upload settings to client
+    int64_t settings_sent = -1; // settings_counter of last settings uploaded
     int main_window; // 0 if top-level, or number of main window
     enum proxy_mode proxyMode;
     enum window_kind wkind : 4;
@@ -282,9 +355,12 @@ public:
     // both sent_count and confirmed_count are modulo MASK28.
     long sent_count; // # bytes sent to (any) tty_client [an 'out' field]
     long confirmed_count; // # bytes confirmed received from (some) tty_client [an 'out' field]
-    struct sbuf inb;  // input buffer (data/events from client) [an 'in' field]
+    struct rbuf inb;  // input buffer (data/events from client) [an 'in' field]
     struct sbuf ob; // data to be sent to UI (or proxy)
     // (a mix of output from pty and from server) [an 'out' field]
+    // Has headroom for LWS_PRE plus OB_HEADER_ROOM, for messages
+    // handle_output sends before the contents, without copying ob.
+#define OB_HEADER_ROOM 512
 
     size_t ocount; // amount to increment sent_count (ocount <= ob.len)
     // (This is bytes read from pty output, and does not include
@@ -293,6 +369,16 @@ public:
     int connection_number; // unique number
     int pty_window_number; // Numbered within each pty_client; -1 if only one
     char *ssh_connection_info;
+    // For proxy_remote, if output to the local end is compressed
+    // (see proxy-compress.cc). [an 'out' field]
+    struct proxy_deflate *proxy_deflate;
+    // For proxy_remote: remote-output-interval keepalive [an 'out' field]
+    // and remote-input-timeout [an 'in' field].
+    struct wheel_timer keepalive_timer;
+    struct wheel_timer input_timer;
+    // Output to a proxy's fd_out that could not be written yet.
+    // [an 'out' field]
+    struct rbuf proxy_pending;
     id_table<struct options> pending_requests;
     std::string window_name;
     std::string description;
@@ -306,7 +392,10 @@ public:
 
 extern id_table<tty_client> tty_clients; // maybe rename to "connections" or "windows"
 extern main_id_table main_windows;
+extern name_index<tty_client> windows_by_name;
 extern void request_enter(struct options *opts, tty_client *tclient);
+extern void watch_notify(const char *event, struct pty_client *pclient,
+                         struct tty_client *tclient, int exit_status = -1);
 
 struct http_client {
     bool owns_data;
@@ -325,13 +414,23 @@ struct browser_cmd_client {
     int cmd_pid = -1;
     int app_number = -1;
     sbuf send_buffer; // for writing to frontend's input
-    sbuf output_buffer; // for reading frontend's output
+    rbuf output_buffer; // for reading frontend's output
     struct lws *wsi = nullptr;
     std::string pattern;
 };
 
 extern id_table<browser_cmd_client> browser_cmd_clients;
 
+// User data for the "watch" protocol: a 'domterm watch' command socket.
+struct watch_client {
+    struct options *options; // the watch request
+    struct lws *wsi;
+    rbuf *queue; // event lines not yet written
+    size_t dropped; // events discarded because queue was full
+    int index(); // options->fd_cmd_socket
+};
+extern id_table<struct watch_client> watchers;
+
 struct cmd_client {
     int socket;
 };
@@ -355,6 +454,9 @@ public:
     int debug_level;
     json cmd_settings;
     json settings; // merge of cmd_settings and global settings
+    int64_t settings_version = -1; // settings_counter when settings merged
+    std::shared_ptr<const settings_snapshot> snapshot; // compiled settings
+    const settings_snapshot& current_settings();
     // Possible memory leak if we start reclaiming options objects.
     std::string browser_command;
     const char *tty_packet_mode;
@@ -430,10 +532,19 @@ callback_browser_cmd(struct lws *wsi, enum lws_callback_reasons reason, void *us
 extern int
 callback_inotify(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len);
 extern int
+callback_await(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len);
+extern int
+callback_tail(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len);
+extern int
+callback_watch(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len);
+extern int
+callback_subprocess(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len);
+extern int
 callback_ssh_stderr(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len);
 
 extern int get_executable_directory_length();
 extern char* get_executable_path();
+extern const char *domterm_socket_dir();
 extern const char* get_resource_dir();
 extern char *get_bin_relative_path(const char* app_path);
 const char *domterm_settings_default(void);
@@ -458,7 +569,8 @@ extern void default_link_command(const char *url);
 extern int process_options(int argc, arglist_t argv, struct options *options);
 extern arglist_t default_command(struct options *opts);
 extern void request_upload_settings();
-extern void read_settings_file(struct options*, bool);
+extern bool read_settings_file(struct options*, bool);
+extern void update_options_settings();
 extern void read_settings_emit_notice();
 extern void merge_settings(json& merged, const json &cmd_settings);
 extern void set_settings(struct options *options); // DEPRECATED
@@ -482,6 +594,7 @@ extern void watch_settings_file(void);
 extern int probe_domterm(bool);
 extern void check_domterm(struct options *);
 extern void generate_random_string (char *buf, int nchars);
+extern void setblocking(int fd, int state);
 extern void tty_save_set_raw(int tty_in);
 extern void tty_restore(int tty_in);
 extern int get_tty_in();
@@ -512,7 +625,8 @@ struct resource {
 extern struct resource resources[];
 #endif
 #define FOREACH_PCLIENT(P) \
-    for (struct pty_client *P = pty_clients.first(); P != nullptr; P = pty_clients.next(P))
+    for (struct pty_client *P = skip_prewarmed(pty_clients.first()); \
+         P != nullptr; P = skip_prewarmed(pty_clients.next(P)))
 #define FOREACH_WSCLIENT(VAR, PCLIENT)      \
   for (struct tty_client *VAR = (PCLIENT)->first_tclient; VAR != NULL; \
        VAR = (VAR)->next_tclient)
@@ -562,6 +676,159 @@ extern int browse_action(int, arglist_t, struct options *);
 extern int view_saved_action(int, arglist_t, struct options *);
 extern int help_action(int, arglist_t, struct options *);
 extern int new_action(int, arglist_t, struct options *);
+extern int watch_action(int, arglist_t, struct options *);
+extern int await_output_action(struct pty_client *pclient, const json& matches,
+                               double timeout, const char *timeout_message,
+                               const char *close_response, struct options *opts);
+extern void scan_process_output(struct pty_client *pclient,
+                                const char *data, size_t length);
+extern void output_scanner_close(struct pty_client *pclient);
+extern void pclient_resume_detached(struct pty_client *pclient);
+extern int tail_action(int, arglist_t, struct options *);
+extern void tap_process_output(struct pty_client *pclient,
+                               const char *data, size_t length);
+extern void output_taps_close(struct pty_client *pclient);
+extern void pclient_write_output(struct pty_client *pclient,
+                                 const char *data, size_t length);
+extern void governor_settings_update();
+extern void governor_count(struct pty_client *pclient, long n);
+extern int governor_discard(struct pty_client *pclient, int fd_in);
+extern void pclient_report_termios(struct pty_client *pclient, int fd_in);
+extern void governor_close(struct pty_client *pclient);
+extern void memory_settings_update();
+extern void memory_check();
+extern size_t pclient_memory_usage(struct pty_client *pclient);
+extern void memory_restore_compacted(struct pty_client *pclient,
+                                     bool window, bool preserved);
+extern void memory_release(struct pty_client *pclient);
+extern void print_memory_status(FILE *out);
+extern size_t memory_compact_window(struct pty_client *pclient);
+extern void memory_discard_window(struct pty_client *pclient);
+extern bool pclient_has_saved_window(struct pty_client *pclient);
+extern size_t saved_window_length(struct pty_client *pclient);
+extern bool snapshot_append_compressed(struct pty_client *pclient, sbuf& sb);
+extern void wheel_timer_arm(struct wheel_timer *timer, long delay_us);
+extern void wheel_timer_cancel(struct wheel_timer *timer);
+extern void timer_wheel_run();
+extern void proxy_compress_request(struct pty_client *pclient,
+                                   struct options *options,
+                                   const char *data, size_t dlen);
+extern ssize_t proxy_inflate_output(struct pty_client *pclient,
+                                    sbuf& ob, size_t n);
+extern void proxy_deflate_start(struct tty_client *tclient, const char *data);
+extern bool proxy_deflate_output(struct tty_client *tclient,
+                                 char **out, size_t *out_len);
+extern void proxy_deflate_congested(struct tty_client *tclient);
+extern void proxy_deflate_close(struct tty_client *tclient);
+extern void proxy_inflate_close(struct pty_client *pclient);
+extern void print_proxy_inflate_status(struct pty_client *pclient, FILE *out);
+extern void print_proxy_deflate_status(struct tty_client *tclient, FILE *out);
+inline void memory_restore(struct pty_client *pclient)
+{
+    if (pclient->compacted)
+        memory_restore_compacted(pclient, true, true);
+}
+inline void memory_restore_window(struct pty_client *pclient)
+{
+    if (pclient->compacted)
+        memory_restore_compacted(pclient, true, false);
+}
+inline void memory_restore_preserved(struct pty_client *pclient)
+{
+    if (pclient->compacted)
+        memory_restore_compacted(pclient, false, true);
+}
+// Called with waitpid status and the output (if captured).
+typedef std::function<void(int status, sbuf& output)> subprocess_callback;
+extern bool start_subprocess(const char *command, bool capture_output,
+                             subprocess_callback callback);
+extern void watch_subprocess(pid_t pid, subprocess_callback callback);
+extern std::vector<pid_t> pending_subprocess_pids();
+
+/* Logging through the ring buffer in logging.cc.
+ * The dtlog macro is for hot paths: it only saves the format and arguments,
+ * which are formatted later by the log writer thread.  The format must
+ * be a string literal, and all conversions must be for long (%ld, %lx).
+ * Levels not in DTLOG_LEVELS are compiled out. */
+#ifndef DTLOG_LEVELS
+#define DTLOG_LEVELS (LLL_ERR|LLL_WARN|LLL_NOTICE|LLL_INFO)
+#endif
+extern int log_levels;
+extern void log_record(int level, const char *format,
+                       long a0 = 0, long a1 = 0, long a2 = 0,
+                       long a3 = 0, long a4 = 0);
+#define dtlog(LEVEL, ...)                                               \
+    do {                                                                \
+        if ((DTLOG_LEVELS & (LEVEL)) != 0 && (log_levels & (LEVEL)) != 0) \
+            log_record(LEVEL, __VA_ARGS__);                             \
+    } while (0)
+extern void log_setup(int levels, FILE *out, bool timestamps);
+extern void log_flush();
+extern void log_after_daemonize();
+extern void log_dump(FILE *out);
+extern int debug_action(int, arglist_t, struct options *);
+extern int upgrade_server_action(int, arglist_t, struct options *);
+extern void maybe_upgrade_server();
+// Server state passed on by 'domterm upgrade-server' (see upgrade.cc).
+struct upgrade_info {
+    int http_port;
+    std::string socket_name;
+    std::string server_key;
+    bool client_can_close;
+};
+extern bool upgrade_state_load(struct upgrade_info *info);
+extern void upgrade_restore_sessions();
+extern struct pty_client *restore_pclient(int fd, int session_number);
+
+/* Declared at the start of a lws callback, so the callback is timed
+ * by the stall watchdog, and shows up in traces from
+ * 'domterm debug trace start' (see trace.cc).
+ * The callback can set session and connection after it finds them. */
+extern bool trace_active;
+inline long monotonic_usec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+struct callback_scope {
+    const char *name;
+    const char *operation = NULL; // possibly-slow operation, if any
+    int reason;
+    int session = -1;
+    int connection = -1;
+    long bytes;
+    long start_us;
+    struct callback_scope *outer;
+    static struct callback_scope *current;
+    callback_scope(const char *name, int reason, size_t len)
+        : name(name), reason(reason), bytes(len) {
+        outer = current;
+        current = this;
+        start_us = monotonic_usec();
+    }
+    ~callback_scope() {
+        current = outer;
+        finish(this);
+    }
+    static void finish(struct callback_scope *);
+};
+// Count bytes handled by the current callback (for tracing).
+inline void trace_bytes(long n)
+{
+    if (callback_scope::current && n > 0)
+        callback_scope::current->bytes += n;
+}
+// Note an operation that may make the current callback slow.
+inline void trace_operation(const char *operation)
+{
+    if (callback_scope::current)
+        callback_scope::current->operation = operation;
+}
+extern const char *trace_start(const char *fname);
+extern char *trace_stop();
+extern void stall_settings_update();
+extern bool print_stalls(FILE *out);
 extern void print_version(FILE*);
 extern void print_help(FILE*);
 extern bool check_server_key(struct lws *wsi, const char *arg);
@@ -14,12 +14,13 @@ const char* settings_fname = NULL;
 json settings_json_object;
 std::string settings_as_json; // JSON of settings_json_object
 int64_t settings_counter = 0;
+// Keys changed by the last re-read (removed keys map to null),
+// plus "##" (new counter) and "#delta" (the counter it applies to).
+static json settings_delta;
+std::string settings_delta_as_json; // JSON of settings_delta, or empty
 
 struct optinfo { enum option_name name; const char *str; int flags; };
 
-#define OPTION_MISC_TYPE 0
-#define OPTION_NUMBER_TYPE 1
-#define OPTION_STRING_TYPE 2
 static struct optinfo options[] = {
 #undef OPTION_S
 #undef OPTION_F
@@ -151,15 +152,37 @@ check_option_arg(const char *arg, struct options *opts)
 
 #if HAVE_INOTIFY
 static int inotify_fd;
+
+// Editors often save a file in several steps (truncate, write, ...),
+// each of which is an inotify event.  Wait for them to settle before
+// re-reading the settings file.
+#define SETTINGS_REREAD_DELAY_USEC 200000
+static struct wheel_timer settings_reread_timer;
+
+static void
+settings_reread(struct wheel_timer *)
+{
+    if (! read_settings_file(main_options, true))
+        return;
+    update_options_settings();
+    prewarm_fill();
+    stall_settings_update();
+    governor_settings_update();
+    memory_settings_update();
+}
+
 int
 callback_inotify(struct lws *wsi, enum lws_callback_reasons reason,
              void *user, void *in, size_t len) {
   //struct cmd_client *cclient = (struct cmd_client *) user;
     char buf[sizeof(struct inotify_event) + NAME_MAX + 1];
+    callback_scope scope("inotify", reason, len);
     switch (reason) {
     case LWS_CALLBACK_RAW_RX_FILE: {
         if (read(inotify_fd, buf, sizeof buf) > 0) {
-            read_settings_file(main_options, true);
+            settings_reread_timer.callback = settings_reread;
+            wheel_timer_arm(&settings_reread_timer,
+                            SETTINGS_REREAD_DELAY_USEC);
         }
         break;
     }
@@ -181,9 +204,40 @@ read_settings_emit_notice()
     lwsl_notice("%s: %s\n", read_settings_message, read_settings_filename);
 }
 
-void
+/* Compute settings_delta from the old and new settings.
+ * Returns false if nothing changed. */
+static bool
+diff_settings(const json& old_settings, const json& new_settings)
+{
+    json delta = json::object();
+    if (old_settings.is_object()) {
+        for (auto& el : old_settings.items()) {
+            if (el.key() != "##" && ! new_settings.contains(el.key()))
+                delta[el.key()] = nullptr;
+        }
+    }
+    for (auto& el : new_settings.items()) {
+        if (el.key() == "##")
+            continue;
+        auto old_value = old_settings.is_object() ? old_settings.find(el.key())
+            : old_settings.end();
+        if (! old_settings.is_object() || old_value == old_settings.end()
+            || *old_value != el.value())
+            delta[el.key()] = el.value();
+    }
+    if (delta.empty())
+        return false;
+    settings_delta = delta;
+    return true;
+}
+
+/** Read (or re-read) the settings file.
+ * Returns false if re-reading found no changes. */
+bool
 read_settings_file(struct options *options, bool re_reading)
 {
+    trace_operation("read_settings_file");
+    json old_settings = std::move(settings_json_object);
     settings_json_object = nullptr;
     json& jobj = settings_json_object;
     if (settings_fname == NULL) {
@@ -209,8 +263,7 @@ read_settings_file(struct options *options, bool re_reading)
     if (re_reading)
         read_settings_emit_notice();
     if (bad)
-        return;
-    jobj["##"] = ++settings_counter;
+        return true;
 
     off_t slen = stbuf.st_size;
     // +1 in case we need to write '\0' at end-of-file
@@ -314,8 +367,24 @@ read_settings_file(struct options *options, bool re_reading)
 
     munmap(sbuf, slen);
     close(settings_fd);
+    if (! jobj.is_object())
+        jobj = json::object();
+    if (! diff_settings(old_settings, jobj) && re_reading) {
+        settings_json_object = std::move(old_settings);
+        return false;
+    }
+    int64_t old_counter = settings_counter;
+    jobj["##"] = ++settings_counter;
     settings_as_json = jobj.dump();
+    settings_delta_as_json.clear();
+    if (old_settings.is_object()) {
+        settings_delta["#delta"] = old_counter;
+        settings_delta["##"] = settings_counter;
+        settings_delta_as_json = settings_delta.dump();
+    } else
+        settings_delta = nullptr;
     request_upload_settings();
+    return true;
 }
 void
 merge_settings(json& merged, const json& cmd_settings)
@@ -332,6 +401,51 @@ merge_settings(json& merged, const json& cmd_settings)
     }
 }
 
+template<int TYPE> static void
+compile_setting(typed_setting<TYPE>& field, const json& settings,
+                const char *key)
+{
+    auto it = settings.find(key);
+    if (it != settings.end() && it->is_string()) {
+        field.is_set = true;
+        field.value = *it;
+    }
+}
+
+static void
+compile_setting(typed_setting<OPTION_NUMBER_TYPE>& field,
+                const json& settings, const char *key)
+{
+    auto it = settings.find(key);
+    if (it != settings.end() && it->is_number()) {
+        field.is_set = true;
+        field.value = double(*it);
+    }
+}
+
+static std::shared_ptr<const settings_snapshot>
+compile_settings(const json& settings)
+{
+    auto snapshot = std::make_shared<settings_snapshot>();
+    snapshot->version = settings_counter;
+#define OPTION_S(NAME, STR, TYPE) \
+    compile_setting(snapshot->NAME, settings, STR);
+#define OPTION_F(NAME, STR, TYPE) \
+    compile_setting(snapshot->NAME, settings, STR);
+#include "option-names.h"
+#undef OPTION_S
+#undef OPTION_F
+    return snapshot;
+}
+
+const settings_snapshot&
+options::current_settings()
+{
+    // Only if set_settings hasn't been called, as for the json settings.
+    static const settings_snapshot empty_snapshot;
+    return snapshot ? *snapshot : empty_snapshot;
+}
+
 void
 set_settings(struct options *options)
 {
@@ -347,6 +461,8 @@ set_settings(struct options *options)
     //options->settings.clear();
     options->settings = nullptr;
     merge_settings(options->settings, options->cmd_settings);
+    options->settings_version = settings_counter;
+    options->snapshot = compile_settings(options->settings);
 
     if (options->shell_argv)
         free((void*) options->shell_argv);
@@ -363,6 +479,51 @@ set_settings(struct options *options)
     options->remote_input_timeout = (long) (d * 1000);
 }
 
+static void
+refresh_options_settings(struct options *options)
+{
+    if (options == NULL || options->settings_version == settings_counter)
+        return;
+    // A delta only helps if these settings are from just before it.
+    auto base = settings_delta.find("#delta");
+    bool changed = base == settings_delta.end()
+        || *base != options->settings_version;
+    for (auto& el : settings_delta.items()) {
+        if (changed)
+            break;
+        if (el.key()[0] != '#'
+            && ! (options->cmd_settings.is_object()
+                  && options->cmd_settings.contains(el.key())))
+            changed = true;
+    }
+    if (changed)
+        set_settings(options);
+    else {
+        // Only "##" differs.
+        options->settings["##"] = settings_counter;
+        options->settings_version = settings_counter;
+        auto snapshot = std::make_shared<settings_snapshot>(*options->snapshot);
+        snapshot->version = settings_counter;
+        options->snapshot = snapshot;
+    }
+}
+
+/** After re-reading the settings file, update the merged settings
+ * of live options objects - unless command-line settings override
+ * all the changed keys. */
+void
+update_options_settings()
+{
+    refresh_options_settings(main_options);
+    struct tty_client *tclient;
+    FORALL_WSCLIENT(tclient) {
+        refresh_options_settings(tclient->options);
+    }
+    FOREACH_MAIN_WINDOW(mclient) {
+        refresh_options_settings(mclient->options);
+    }
+}
+
 void
 watch_settings_file()
 {
@@ -0,0 +1,248 @@
+/* Running helper commands without blocking the server.
+ *
+ * Helpers such as the clipboard commands (xclip, wl-paste) or a browser
+ * can take a while, and system or popen_read would freeze every session
+ * until they are done.  Instead start_subprocess returns right away,
+ * and the callback is called (from the lws loop) when the command exits,
+ * with the waitpid status and (optionally) what it wrote to stdout.
+ *
+ * A SIGCHLD handler writes a byte to a pipe adopted by lws (using the
+ * "subprocess" protocol); we then reap, using WNOHANG, just the
+ * processes we started.  A command's stdout, if wanted, is another
+ * pipe read by the lws loop.
+ */
+
+#include "server.h"
+
+struct subprocess {
+    pid_t pid;
+    int status;
+    bool exited;
+    int out_fd; // reading command's stdout, or -1
+    struct lws *out_wsi; // for out_fd - NULL after it is closed
+    sbuf output;
+    subprocess_callback callback;
+};
+
+static std::vector<struct subprocess *> subprocesses;
+static int sigchld_pipe[2] = { -1, -1 };
+
+static void
+sigchld_handler(int sig)
+{
+    int save_errno = errno;
+    char ch = 0;
+    if (write(sigchld_pipe[1], &ch, 1) < 0) {
+        // Pipe is full, so a wakeup is already pending.
+    }
+    errno = save_errno;
+}
+
+static bool
+subprocess_init()
+{
+    if (sigchld_pipe[0] >= 0)
+        return true;
+    if (pipe(sigchld_pipe) < 0) {
+        lwsl_err("subprocess pipe failed: %s\n", strerror(errno));
+        return false;
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(sigchld_pipe[i], F_SETFD, FD_CLOEXEC);
+        setblocking(sigchld_pipe[i], 0);
+    }
+    lws_sock_file_fd_type fd;
+    fd.filefd = sigchld_pipe[0];
+    if (lws_adopt_descriptor_vhost(vhost, LWS_ADOPT_RAW_FILE_DESC, fd,
+                                   "subprocess", NULL) == NULL) {
+        lwsl_err("failed to register SIGCHLD pipe\n");
+        close(sigchld_pipe[0]);
+        close(sigchld_pipe[1]);
+        sigchld_pipe[0] = sigchld_pipe[1] = -1;
+        return false;
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigchld_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &sa, NULL);
+    return true;
+}
+
+// Call the callback once the process has exited and its output is read.
+static void
+subprocess_maybe_finish(struct subprocess *sp)
+{
+    if (! sp->exited || sp->out_wsi != NULL)
+        return;
+    for (auto it = subprocesses.begin(); it != subprocesses.end(); it++) {
+        if (*it == sp) {
+            subprocesses.erase(it);
+            break;
+        }
+    }
+    lwsl_info("subprocess %d finished status:%x output:%zu\n",
+              sp->pid, sp->status, sp->output.len);
+    if (sp->callback)
+        sp->callback(sp->status, sp->output);
+    delete sp;
+}
+
+static void
+reap_subprocesses()
+{
+    // Copy, since a callback may start another subprocess.
+    std::vector<struct subprocess *> pending = subprocesses;
+    for (struct subprocess *sp : pending) {
+        if (sp->exited)
+            continue;
+        pid_t r = waitpid(sp->pid, &sp->status, WNOHANG);
+        if (r == sp->pid || (r < 0 && errno == ECHILD)) {
+            if (r < 0)
+                sp->status = -1;
+            sp->exited = true;
+            subprocess_maybe_finish(sp);
+        }
+    }
+}
+
+static struct subprocess *
+subprocess_enter(pid_t pid, subprocess_callback callback)
+{
+    struct subprocess *sp = new subprocess();
+    sp->pid = pid;
+    sp->status = -1;
+    sp->exited = false;
+    sp->out_fd = -1;
+    sp->out_wsi = NULL;
+    sp->callback = callback;
+    subprocesses.push_back(sp);
+    return sp;
+}
+
+int
+callback_subprocess(struct lws *wsi, enum lws_callback_reasons reason,
+                    void *user, void *in, size_t len)
+{
+    struct subprocess **spp = (struct subprocess **) user;
+    struct subprocess *sp = spp ? *spp : nullptr;
+    callback_scope scope("subprocess", reason, len);
+    switch (reason) {
+    case LWS_CALLBACK_RAW_RX_FILE: {
+        if (sp == nullptr) {
+            // The SIGCHLD pipe.
+            char buf[64];
+            while (read(sigchld_pipe[0], buf, sizeof(buf)) > 0) {
+            }
+            reap_subprocesses();
+            break;
+        }
+        sp->output.extend(4096);
+        ssize_t n = read(sp->out_fd, sp->output.avail_start(),
+                         sp->output.avail_space());
+        if (n > 0)
+            sp->output.len += n;
+        else if (n == 0 || (errno != EAGAIN && errno != EINTR))
+            return -1; // closes out_fd
+        break;
+    }
+    case LWS_CALLBACK_RAW_CLOSE_FILE:
+        if (sp != nullptr) {
+            sp->out_wsi = NULL;
+            sp->out_fd = -1;
+            *spp = nullptr;
+            subprocess_maybe_finish(sp);
+        }
+        break;
+    default:
+        break;
+    }
+    return 0;
+}
+
+/** Reap child process pid (started some other way) when it exits,
+ * and then call callback (if non-empty). */
+void
+watch_subprocess(pid_t pid, subprocess_callback callback)
+{
+    if (subprocess_init()) {
+        subprocess_enter(pid, callback);
+        // In case it has already exited (and we missed the SIGCHLD).
+        sigchld_handler(SIGCHLD);
+    }
+}
+
+/** The pids of the commands started by start_subprocess (or watched)
+ * that haven't exited yet. */
+std::vector<pid_t>
+pending_subprocess_pids()
+{
+    std::vector<pid_t> pids;
+    for (struct subprocess *sp : subprocesses) {
+        if (! sp->exited)
+            pids.push_back(sp->pid);
+    }
+    return pids;
+}
+
+/** Run command using the shell (like system) without waiting for it.
+ * If capture_output, the output of command is passed to callback;
+ * otherwise command writes to the server's stdout.
+ * Returns false if the command could not be started.
+ */
+bool
+start_subprocess(const char *command, bool capture_output,
+                 subprocess_callback callback)
+{
+    if (! subprocess_init())
+        return false;
+    int out_fds[2];
+    if (capture_output) {
+        if (pipe(out_fds) < 0)
+            return false;
+        fcntl(out_fds[0], F_SETFD, FD_CLOEXEC);
+    }
+    const char *argv[] = { "/bin/sh", "-c", command, NULL };
+    pid_t pid = vfork();
+    if (pid == 0) {
+        int nfd = open("/dev/null", O_RDONLY);
+        if (nfd > 0) {
+            dup2(nfd, 0);
+            close(nfd);
+        }
+        if (capture_output) {
+            dup2(out_fds[1], 1);
+            close(out_fds[1]);
+        }
+        execv(argv[0], (char * const*) argv);
+        _exit(127);
+    }
+    if (capture_output)
+        close(out_fds[1]);
+    if (pid < 0) {
+        lwsl_err("could not fork for '%s': %s\n", command, strerror(errno));
+        if (capture_output)
+            close(out_fds[0]);
+        return false;
+    }
+    lwsl_notice("started subprocess %d: %s\n", pid, command);
+    struct subprocess *sp = subprocess_enter(pid, callback);
+    if (capture_output) {
+        setblocking(out_fds[0], 0);
+        lws_sock_file_fd_type fd;
+        fd.filefd = out_fds[0];
+        struct lws *owsi = lws_adopt_descriptor_vhost(vhost,
+                                                      LWS_ADOPT_RAW_FILE_DESC,
+                                                      fd, "subprocess", NULL);
+        if (owsi == NULL) {
+            lwsl_err("failed to register subprocess output\n");
+            close(out_fds[0]);
+        } else {
+            sp->out_fd = out_fds[0];
+            sp->out_wsi = owsi;
+            *(struct subprocess **) lws_wsi_user(owsi) = sp;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,128 @@
+/* A shared timer wheel, for the keepalives and timeouts of remote sessions.
+ *
+ * Each remote session has timers that must be pushed back whenever data
+ * arrives or is sent (see remote-output-timeout and friends).  Re-arming
+ * an lws timer for each chunk of output is costly with many sessions.
+ * Instead, a wheel_timer is re-armed "lazily": if it is already in the
+ * wheel at or before the new deadline, wheel_timer_arm just records the
+ * new deadline.  When its slot comes up, a timer whose deadline has moved
+ * is put back in the wheel, instead of firing.  So a busy session costs
+ * one store per chunk, and an idle one nothing until its timer is due.
+ *
+ * The wheel has WHEEL_SLOTS slots of WHEEL_TICK_USEC each; a timer
+ * further away than one revolution stays in its slot until its tick.
+ * timer_wheel_run is called from the main loop (which wakes up at least
+ * every 100ms), and fires all timers due since the last call together.
+ */
+
+#include "server.h"
+
+#define WHEEL_TICK_USEC 100000
+#define WHEEL_SLOTS 256
+
+static struct wheel_timer wheel_slots[WHEEL_SLOTS]; // list heads
+static long wheel_tick = -1; // next tick to process; -1 before first use
+
+static long
+deadline_tick(long deadline_us)
+{
+    return (deadline_us + WHEEL_TICK_USEC - 1) / WHEEL_TICK_USEC;
+}
+
+static void
+wheel_init()
+{
+    for (int i = 0; i < WHEEL_SLOTS; i++)
+        wheel_slots[i].next = wheel_slots[i].prev = &wheel_slots[i];
+    wheel_tick = monotonic_usec() / WHEEL_TICK_USEC;
+}
+
+static void
+wheel_unlink(struct wheel_timer *timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = timer->prev = NULL;
+}
+
+static void
+wheel_insert(struct wheel_timer *timer, struct wheel_timer *head)
+{
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+static void
+wheel_schedule(struct wheel_timer *timer)
+{
+    long tick = deadline_tick(timer->deadline_us);
+    if (tick < wheel_tick)
+        tick = wheel_tick;
+    timer->tick = tick;
+    wheel_insert(timer, &wheel_slots[tick % WHEEL_SLOTS]);
+}
+
+/** (Re-)arm timer to fire after delay_us microseconds. */
+void
+wheel_timer_arm(struct wheel_timer *timer, long delay_us)
+{
+    if (wheel_tick < 0)
+        wheel_init();
+    long deadline = monotonic_usec() + delay_us;
+    if (timer->next != NULL) {
+        timer->deadline_us = deadline;
+        // It will be checked no later than the new deadline.
+        if (timer->tick <= deadline_tick(deadline))
+            return;
+        wheel_unlink(timer);
+    }
+    timer->deadline_us = deadline;
+    wheel_schedule(timer);
+}
+
+void
+wheel_timer_cancel(struct wheel_timer *timer)
+{
+    if (timer->next != NULL)
+        wheel_unlink(timer);
+    timer->deadline_us = 0;
+}
+
+/** Fire the timers that are due.  Called from the main loop. */
+void
+timer_wheel_run()
+{
+    if (wheel_tick < 0)
+        return;
+    long now = monotonic_usec();
+    long now_tick = now / WHEEL_TICK_USEC;
+    // After a long pause, visiting each slot once is enough.
+    if (now_tick - wheel_tick >= WHEEL_SLOTS)
+        wheel_tick = now_tick - WHEEL_SLOTS + 1;
+    struct wheel_timer due;
+    due.next = due.prev = &due;
+    for (; wheel_tick <= now_tick; wheel_tick++) {
+        struct wheel_timer *head = &wheel_slots[wheel_tick % WHEEL_SLOTS];
+        struct wheel_timer *next;
+        for (struct wheel_timer *t = head->next; t != head; t = next) {
+            next = t->next;
+            if (t->tick > wheel_tick)
+                continue; // a later revolution
+            wheel_unlink(t);
+            if (t->deadline_us > now)
+                wheel_schedule(t); // re-armed since; goes to a later tick
+            else
+                wheel_insert(t, &due);
+        }
+    }
+    // A callback may cancel (or re-arm) timers still in due.
+    while (due.next != &due) {
+        struct wheel_timer *t = due.next;
+        wheel_unlink(t);
+        t->deadline_us = 0;
+        if (t->callback != NULL)
+            t->callback(t);
+    }
+}
@@ -0,0 +1,189 @@
+/* Timing and tracing of lws callbacks, for finding what is slowing
+ * down the server.
+ *
+ * Since everything runs on one lws loop, a slow callback delays all
+ * sessions.  Each callback that declares a callback_scope is timed;
+ * if it takes longer than the debug.stall-threshold setting, it is
+ * logged (as a warning) and remembered for 'domterm status --stalls'.
+ *
+ * 'domterm debug trace start [FILE]' starts recording an event for each
+ * callback that declares a callback_scope; 'domterm debug trace stop'
+ * stops recording and closes FILE.  The output uses the Trace Event
+ * JSON format, as understood by chrome://tracing and ui.perfetto.dev.
+ * Each event is a "complete" event (with start and duration) whose
+ * name is the protocol, with the callback reason, session and connection
+ * numbers, and byte count as arguments.
+ */
+
+#include "server.h"
+
+#define TRACE_FLUSH_SIZE 65536
+#define STALLS_MAX 64
+#define STALL_THRESHOLD_DEFAULT 0.1 /* seconds */
+
+struct stall {
+    time_t when;
+    const char *name;
+    const char *operation;
+    int reason;
+    int session;
+    int connection;
+    long duration_us;
+};
+
+bool trace_active = false;
+struct callback_scope *callback_scope::current = NULL;
+static FILE *trace_file = NULL;
+static char *trace_file_name = NULL;
+static long trace_events = 0;
+static sbuf trace_buffer;
+static struct stall stalls[STALLS_MAX]; // ring buffer
+static long stalls_count = 0; // total number of stalls seen
+static long stall_threshold_us = (long) (STALL_THRESHOLD_DEFAULT * 1000000);
+
+/** Update watchdog threshold from debug.stall-threshold setting. */
+void
+stall_settings_update()
+{
+    json settings;
+    merge_settings(settings, main_options->cmd_settings);
+    double d = get_setting_d(settings, "debug.stall-threshold",
+                             STALL_THRESHOLD_DEFAULT);
+    stall_threshold_us = d <= 0 ? -1 : (long) (d * 1000000);
+}
+
+static void
+record_stall(struct callback_scope *scope, long duration_us)
+{
+    struct stall *st = &stalls[stalls_count % STALLS_MAX];
+    st->when = time(NULL);
+    st->name = scope->name;
+    st->operation = scope->operation;
+    st->reason = scope->reason;
+    st->session = scope->session;
+    st->connection = scope->connection;
+    st->duration_us = duration_us;
+    stalls_count++;
+    lwsl_warn("stall: %s callback (reason:%d session:%d conn:%d%s%s) took %ld ms\n",
+              scope->name, scope->reason, scope->session, scope->connection,
+              scope->operation ? " in " : "",
+              scope->operation ? scope->operation : "",
+              duration_us / 1000);
+}
+
+/** Print recent stalls, most recent first.
+ * Returns false if there have been none. */
+bool
+print_stalls(FILE *out)
+{
+    if (stalls_count == 0)
+        return false;
+    fprintf(out, "%ld stall(s) longer than %ld ms", stalls_count,
+            stall_threshold_us / 1000);
+    if (stalls_count > STALLS_MAX)
+        fprintf(out, " (showing last %d)", STALLS_MAX);
+    fprintf(out, ":\n");
+    long first = stalls_count > STALLS_MAX ? stalls_count - STALLS_MAX : 0;
+    for (long i = stalls_count; --i >= first; ) {
+        struct stall *st = &stalls[i % STALLS_MAX];
+        struct tm tm;
+        localtime_r(&st->when, &tm);
+        fprintf(out, "  %02d:%02d:%02d %6ld ms %s reason:%d",
+                tm.tm_hour, tm.tm_min, tm.tm_sec,
+                st->duration_us / 1000, st->name, st->reason);
+        if (st->session >= 0)
+            fprintf(out, " session#%d", st->session);
+        if (st->connection >= 0)
+            fprintf(out, " conn#%d", st->connection);
+        if (st->operation)
+            fprintf(out, " in %s", st->operation);
+        fprintf(out, "\n");
+    }
+    return true;
+}
+
+static void
+trace_flush()
+{
+    if (trace_buffer.len > 0) {
+        fwrite(trace_buffer.buffer, 1, trace_buffer.len, trace_file);
+        fflush(trace_file);
+        trace_buffer.len = 0;
+    }
+}
+
+void
+callback_scope::finish(struct callback_scope *scope)
+{
+    long end_us = monotonic_usec();
+    if (stall_threshold_us >= 0
+        && end_us - scope->start_us >= stall_threshold_us)
+        record_stall(scope, end_us - scope->start_us);
+    if (! trace_active)
+        return;
+    trace_buffer.printf("%s{\"name\":\"%s\",\"cat\":\"lws\",\"ph\":\"X\","
+                        "\"ts\":%ld,\"dur\":%ld,\"pid\":%d,\"tid\":1,"
+                        "\"args\":{\"reason\":%d",
+                        trace_events == 0 ? "" : ",\n",
+                        scope->name, scope->start_us,
+                        end_us - scope->start_us, (int) getpid(),
+                        scope->reason);
+    if (scope->session >= 0)
+        trace_buffer.printf(",\"session\":%d", scope->session);
+    if (scope->connection >= 0)
+        trace_buffer.printf(",\"connection\":%d", scope->connection);
+    if (scope->bytes > 0)
+        trace_buffer.printf(",\"bytes\":%ld", scope->bytes);
+    if (scope->operation)
+        trace_buffer.printf(",\"operation\":\"%s\"", scope->operation);
+    trace_buffer.append("}}");
+    trace_events++;
+    if (trace_buffer.len >= TRACE_FLUSH_SIZE)
+        trace_flush();
+}
+
+/** Start tracing to fname.
+ * Returns NULL on success, or an error message. */
+const char *
+trace_start(const char *fname)
+{
+    if (trace_active)
+        return "already tracing";
+    // Don't follow a symlink, and don't let others read the trace.
+    int fd = open(fname, O_WRONLY|O_CREAT|O_TRUNC|O_NOFOLLOW|O_CLOEXEC,
+                  0600);
+    trace_file = fd < 0 ? NULL : fdopen(fd, "w");
+    if (trace_file == NULL) {
+        const char *err = strerror(errno);
+        if (fd >= 0)
+            close(fd);
+        return err;
+    }
+    trace_file_name = strdup(fname);
+    trace_events = 0;
+    trace_buffer.append("[\n");
+    trace_active = true;
+    lwsl_notice("started tracing to %s\n", fname);
+    return NULL;
+}
+
+/** Stop tracing and close the trace file.
+ * Returns the name of the file (to be freed by the caller),
+ * or NULL if not tracing. */
+char *
+trace_stop()
+{
+    if (! trace_active)
+        return NULL;
+    trace_active = false;
+    trace_buffer.append("\n]\n");
+    trace_flush();
+    trace_buffer.reset();
+    fclose(trace_file);
+    trace_file = NULL;
+    lwsl_notice("stopped tracing to %s - %ld events\n",
+                trace_file_name, trace_events);
+    char *fname = trace_file_name;
+    trace_file_name = NULL;
+    return fname;
+}
@@ -0,0 +1,345 @@
+/* Upgrading the server without ending sessions: 'domterm upgrade-server'.
+ *
+ * The server process re-executes the (normally newly installed) domterm
+ * program.  Since the process stays the same, the session processes
+ * are still our children.  The pty master of each local session is kept
+ * open across the exec, and the state needed to continue each session
+ * is written to a file named by the DOMTERM_UPGRADE_STATE variable.
+ * The new server adopts the ptys, keeps the same http port and server
+ * key, and so browser windows can reconnect (as they do after a network
+ * problem) and get missed output replayed from preserved_output.
+ *
+ * The state file contains a line of JSON, followed by the raw bytes of
+ * each session's preserved output and saved window contents, in order.
+ * The options the server was started with (such as --settings) are
+ * passed again to the new server, but not the command.
+ *
+ * Remote (ssh) sessions can't be preserved, and are ended.
+ * So are prewarmed sessions (see prewarm_fill): closing their pty
+ * hangs them up.  Their pids, and those of running helper commands
+ * (see start_subprocess), are passed to the new server to be reaped,
+ * so they don't stay around as zombies.
+ */
+
+#include "server.h"
+#include <dirent.h>
+
+#define UPGRADE_STATE_ENV "DOMTERM_UPGRADE_STATE"
+
+static bool upgrade_requested = false;
+static std::string upgrade_program;
+
+static std::string
+upgrade_state_filename()
+{
+    sbuf sb;
+    sb.printf("%s.upgrade", backend_socket_name);
+    return std::string(sb.buffer, sb.len);
+}
+
+int upgrade_server_action(int argc, arglist_t argv, struct options *opts)
+{
+    if (argc > 2) {
+        printf_error(opts, "too many arguments to upgrade-server");
+        return EXIT_BAD_CMDARG;
+    }
+    std::string program;
+    if (argc == 2) {
+        program = argv[1];
+        if (program[0] != '/' && opts->cwd)
+            program = std::string(opts->cwd) + "/" + program;
+    } else {
+        program = get_executable_path();
+        // If the program was replaced while running, Linux says so.
+        const char deleted[] = " (deleted)";
+        size_t dlen = sizeof(deleted) - 1;
+        if (program.length() > dlen
+            && program.compare(program.length() - dlen, dlen, deleted) == 0)
+            program.erase(program.length() - dlen);
+    }
+    if (access(program.c_str(), X_OK) != 0) {
+        printf_error(opts, "cannot execute '%s'", program.c_str());
+        return EXIT_FAILURE;
+    }
+    int nlocal = 0, nremote = 0;
+    FOREACH_PCLIENT(pclient) {
+        if (pclient->is_ssh_pclient)
+            nremote++;
+        else
+            nlocal++;
+    }
+    FILE *out = fdopen(dup(opts->fd_out), "w");
+    fprintf(out, "Upgrading server to %s (%d session%s preserved).\n",
+            program.c_str(), nlocal, nlocal == 1 ? "" : "s");
+    if (nremote > 0)
+        fprintf(out, "Warning: %d remote session%s will be ended.\n",
+                nremote, nremote == 1 ? "" : "s");
+    fclose(out);
+    upgrade_program = program;
+    // Do the actual upgrade from the main loop, after replying.
+    upgrade_requested = true;
+    return EXIT_SUCCESS;
+}
+
+static void
+set_cloexec(int fd, bool on)
+{
+    int flags = fcntl(fd, F_GETFD);
+    if (flags >= 0)
+        fcntl(fd, F_SETFD, on ? (flags | FD_CLOEXEC) : (flags & ~FD_CLOEXEC));
+}
+
+/** Called from the main loop; does a requested upgrade.
+ * Only returns if the upgrade failed. */
+void
+maybe_upgrade_server()
+{
+    if (! upgrade_requested)
+        return;
+    upgrade_requested = false;
+
+    json state;
+    state["http-port"] = http_port;
+    state["server-key"] = std::string(server_key, SERVER_KEY_LENGTH);
+    state["socket-name"] = backend_socket_name;
+    state["client-can-close"] = tserver.client_can_close;
+    json sessions = json::array();
+    sbuf blobs;
+    std::vector<int> keep_fds;
+    FOREACH_PCLIENT(pclient) {
+        if (pclient->is_ssh_pclient || pclient->pid <= 0)
+            continue;
+        json jsession;
+        jsession["fd"] = pclient->pty;
+        jsession["pid"] = pclient->pid;
+        jsession["session-number"] = pclient->session_number;
+        if (! pclient->session_name.empty())
+            jsession["name"] = pclient->session_name;
+        if (pclient->cmd)
+            jsession["cmd"] = pclient->cmd;
+        if (pclient->argv) {
+            json jargv = json::array();
+            for (arglist_t p = pclient->argv; *p; p++)
+                jargv.push_back(*p);
+            jsession["argv"] = jargv;
+        }
+        if (pclient->ttyname)
+            jsession["ttyname"] = pclient->ttyname;
+        jsession["nrows"] = pclient->nrows;
+        jsession["ncols"] = pclient->ncols;
+        jsession["packet-mode"] = (bool) pclient->uses_packet_mode;
+        jsession["xtermjs"] = (bool) pclient->use_xtermjs;
+        jsession["ghostty"] = (bool) pclient->use_ghostty;
+        jsession["detach-count"] = pclient->detach_count;
+        jsession["preserve-mode"] = (int) pclient->preserve_mode;
+        memory_restore(pclient);
+        size_t plen = 0;
+        if (pclient->preserved_output) {
+            plen = pclient->preserved_end - pclient->preserved_start;
+            blobs.append(pclient->preserved_output + pclient->preserved_start,
+                         plen);
+        }
+        jsession["preserved-length"] = plen;
+        jsession["preserved-sent-count"] = pclient->preserved_sent_count;
+        size_t wlen = 0;
+        if (pclient->saved_window_contents
+            && ! pclient->saved_window_is_base) {
+            wlen = strlen(pclient->saved_window_contents);
+            blobs.append(pclient->saved_window_contents, wlen);
+        }
+        jsession["saved-window-length"] = wlen;
+        jsession["saved-window-sent-count"] =
+            pclient->saved_window_sent_count;
+        sessions.push_back(jsession);
+        keep_fds.push_back(pclient->pty);
+    }
+    state["sessions"] = sessions;
+    // Our children that the new server won't adopt; it just reaps them.
+    json children = json::array();
+    for (struct pty_client *pclient = pty_clients.first();
+         pclient != nullptr; pclient = pty_clients.next(pclient)) {
+        if ((pclient->is_ssh_pclient || pclient->prewarmed)
+            && pclient->pid > 0)
+            children.push_back(pclient->pid);
+    }
+    for (pid_t pid : pending_subprocess_pids())
+        children.push_back(pid);
+    state["children"] = children;
+
+    std::string fname = upgrade_state_filename();
+    int sfd = open(fname.c_str(), O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+    std::string header = state.dump(-1, ' ', false,
+                                    json::error_handler_t::replace);
+    header += '\n';
+    if (sfd < 0
+        || write(sfd, header.c_str(), header.length()) != (ssize_t) header.length()
+        || write(sfd, blobs.buffer, blobs.len) != (ssize_t) blobs.len) {
+        lwsl_err("upgrade-server: cannot write state to %s: %s\n",
+                 fname.c_str(), strerror(errno));
+        if (sfd >= 0)
+            close(sfd);
+        unlink(fname.c_str());
+        return;
+    }
+    close(sfd);
+
+    // Only the ptys (and stdin/stdout/stderr) survive the exec.
+    DIR *dir = opendir("/proc/self/fd");
+    if (dir != NULL) {
+        struct dirent *ent;
+        while ((ent = readdir(dir)) != NULL) {
+            int fd = atoi(ent->d_name);
+            if (fd > 2 && fd != dirfd(dir))
+                set_cloexec(fd, true);
+        }
+        closedir(dir);
+    } else {
+        int maxfd = sysconf(_SC_OPEN_MAX);
+        for (int fd = 3; fd < maxfd; fd++)
+            set_cloexec(fd, true);
+    }
+    for (int fd : keep_fds)
+        set_cloexec(fd, false);
+
+    setenv(UPGRADE_STATE_ENV, fname.c_str(), 1);
+    char dlevel[20];
+    snprintf(dlevel, sizeof(dlevel), "--debug=%d", log_levels);
+    std::vector<const char *> args;
+    args.push_back(upgrade_program.c_str());
+    for (const std::string& arg : server_startup_args) {
+        // Added by us below (perhaps by a previous upgrade).
+        if (arg == "--no-daemonize" || arg.compare(0, 8, "--debug=") == 0)
+            continue;
+        args.push_back(arg.c_str());
+    }
+    args.push_back("--no-daemonize");
+    args.push_back(dlevel);
+    args.push_back(NULL);
+    lwsl_notice("upgrade-server: executing %s with %d sessions\n",
+                upgrade_program.c_str(), (int) keep_fds.size());
+    log_flush();
+    execv(args[0], (char * const *) args.data());
+
+    lwsl_err("upgrade-server: exec of %s failed: %s\n",
+             upgrade_program.c_str(), strerror(errno));
+    unsetenv(UPGRADE_STATE_ENV);
+    unlink(fname.c_str());
+}
+
+static json upgrade_state;
+static sbuf upgrade_blobs;
+
+/** If this server was started by upgrade-server, read the saved state.
+ * Returns false for a normal start. */
+bool
+upgrade_state_load(struct upgrade_info *info)
+{
+    const char *fname = getenv(UPGRADE_STATE_ENV);
+    if (fname == NULL)
+        return false;
+    std::string sfname = fname;
+    unsetenv(UPGRADE_STATE_ENV);
+    FILE *f = fopen(sfname.c_str(), "r");
+    if (f == NULL) {
+        lwsl_err("upgrade: cannot read %s\n", sfname.c_str());
+        return false;
+    }
+    sbuf sb;
+    sb.copy_file(f);
+    fclose(f);
+    unlink(sfname.c_str());
+    const char *nl = (const char *) memchr(sb.buffer, '\n', sb.len);
+    if (nl == NULL)
+        return false;
+    upgrade_state = json::parse((const char *) sb.buffer, nl, nullptr, false);
+    if (! upgrade_state.is_object())
+        return false;
+    upgrade_blobs.append(nl + 1, sb.buffer + sb.len - (nl + 1));
+    info->http_port = upgrade_state.value("http-port", 0);
+    info->socket_name = upgrade_state.value("socket-name", "");
+    info->server_key = upgrade_state.value("server-key", "");
+    info->client_can_close = upgrade_state.value("client-can-close", true);
+    return true;
+}
+
+/** Adopt the sessions saved by upgrade-server. */
+void
+upgrade_restore_sessions()
+{
+    size_t blob_offset = 0;
+    auto jchildren = upgrade_state.find("children");
+    if (jchildren != upgrade_state.end() && jchildren->is_array()) {
+        for (auto& jpid : *jchildren) {
+            if (jpid.is_number_integer())
+                watch_subprocess(jpid.get<pid_t>(), nullptr);
+        }
+    }
+    auto jsessions = upgrade_state.find("sessions");
+    if (jsessions == upgrade_state.end() || ! jsessions->is_array())
+        return;
+    for (auto& jsession : *jsessions) {
+        int fd = jsession.value("fd", -1);
+        size_t plen = jsession.value("preserved-length", (size_t) 0);
+        size_t wlen = jsession.value("saved-window-length", (size_t) 0);
+        const char *blob = upgrade_blobs.buffer + blob_offset;
+        blob_offset += plen + wlen;
+        if (fd < 0 || blob_offset > upgrade_blobs.len)
+            continue;
+        set_cloexec(fd, true);
+        struct pty_client *pclient =
+            restore_pclient(fd, jsession.value("session-number", -1));
+        if (pclient == NULL) {
+            close(fd);
+            continue;
+        }
+        pclient->pid = jsession.value("pid", -1);
+        std::string name = jsession.value("name", "");
+        if (! name.empty())
+            pclient->set_session_name(name);
+        std::string cmd = jsession.value("cmd", "");
+        if (! cmd.empty())
+            pclient->cmd = strdup(cmd.c_str());
+        auto jargv = jsession.find("argv");
+        if (jargv != jsession.end() && jargv->is_array()) {
+            std::vector<std::string> strs;
+            for (auto& a : *jargv)
+                strs.push_back(a.is_string() ? a.get<std::string>() : "");
+            std::vector<const char *> ptrs;
+            for (auto& str : strs)
+                ptrs.push_back(str.c_str());
+            ptrs.push_back(NULL);
+            pclient->argv = copy_strings(ptrs.data());
+        }
+        std::string tname = jsession.value("ttyname", "");
+        if (! tname.empty())
+            pclient->ttyname = strdup(tname.c_str());
+        pclient->nrows = jsession.value("nrows", -1);
+        pclient->ncols = jsession.value("ncols", -1);
+        pclient->uses_packet_mode = jsession.value("packet-mode", false);
+        pclient->use_xtermjs = jsession.value("xtermjs", false);
+        pclient->use_ghostty = jsession.value("ghostty", false);
+        pclient->detach_count = jsession.value("detach-count", 0);
+        pclient->preserve_mode = jsession.value("preserve-mode", 1);
+        if (plen > 0) {
+            pclient->preserved_output = (char *) xmalloc(plen);
+            memcpy(pclient->preserved_output, blob, plen);
+            pclient->preserved_start = 0;
+            pclient->preserved_end = plen;
+            pclient->preserved_size = plen;
+        }
+        pclient->preserved_sent_count =
+            jsession.value("preserved-sent-count", 0L);
+        if (wlen > 0) {
+            pclient->saved_window_contents = (char *) xmalloc(wlen + 1);
+            memcpy(pclient->saved_window_contents, blob + plen, wlen);
+            pclient->saved_window_contents[wlen] = '\0';
+        }
+        pclient->saved_window_sent_count =
+            jsession.value("saved-window-sent-count", 0L);
+        lwsl_notice("upgrade: restored session %d pid:%d pty:%d\n",
+                    pclient->session_number, pclient->pid, fd);
+        watch_notify("session-created", pclient, NULL);
+    }
+    upgrade_state = nullptr;
+    upgrade_blobs.reset();
+}
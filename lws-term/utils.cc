@@ -842,6 +842,7 @@ sbuf::sbuf()
     buffer = NULL;
     len = 0;
     size = 0;
+    headroom = 0;
 }
 
 sbuf::~sbuf()
@@ -867,10 +868,22 @@ sbuf::extend(int needed)
         if (min_size < xsize)
             min_size = xsize;
         size = min_size;
-        buffer = (char*) realloc(buffer, min_size);
+        char *base = buffer == NULL ? NULL : buffer - headroom;
+        base = (char*) realloc(base, headroom + min_size);
+        buffer = base + headroom;
     }
 }
 
+/* Allocate space bytes before buffer (which can only be done while
+ * the sbuf is empty).  This lets a caller prefix the contents in place,
+ * for example with the LWS_PRE bytes lws_write needs. */
+void sbuf::set_headroom(size_t space)
+{
+    if (buffer != NULL)
+        reset();
+    headroom = space;
+}
+
 void* sbuf::blank(int space)
 {
     extend(space);
@@ -898,7 +911,7 @@ void sbuf::append(const char *bytes, ssize_t length)
 void sbuf::reset()
 {
     if (buffer != NULL)
-        free(buffer);
+        free(buffer - headroom);
     buffer = NULL;
     len = 0;
     size = 0;
@@ -908,10 +921,30 @@ void sbuf::erase(size_t index, size_t count)
 {
     if (count > len - index)
         count = len - index;
-    memmove(buffer + index, buffer + index + count, len - index + count);
+    memmove(buffer + index, buffer + index + count, len - index - count);
     len -= count;
 }
 
+void rbuf::consume(size_t count)
+{
+    pos += count;
+    if (pos >= len) {
+        pos = 0;
+        len = 0;
+    }
+}
+
+void rbuf::reserve(int needed)
+{
+    size_t remaining = len - pos;
+    if (pos > 0 && pos >= remaining) {
+        memmove(buffer, buffer + pos, remaining);
+        len = remaining;
+        pos = 0;
+    }
+    extend(needed);
+}
+
 void
 sbuf::vprintf(const char *format, va_list ap)
 {
@@ -983,6 +1016,7 @@ printf_error(const struct options *opts, const char *format, ...)
 int
 popen_read(const char *command, sbuf& sb)
 {
+    trace_operation("popen_read");
     FILE *f = popen(command, "r");
     if (f == NULL)
         return -1;
@@ -71,6 +71,7 @@ public:
         append(sb.buffer, sb.len);
     }
     void* blank(int space);
+    void set_headroom(size_t space);
     size_t avail_space() { return size - len; }
     char *avail_start() { return buffer + len; }
     char *null_terminated();
@@ -92,6 +93,24 @@ public:
     char *buffer;
     size_t len;
     size_t size;
+    // Bytes allocated (and writable) before buffer; see set_headroom.
+    size_t headroom;
+};
+
+/** An sbuf that is consumed from the front, as when reading
+ * a stream of messages.  Consuming just moves the read position;
+ * the rest is only moved to the front when that costs no more than
+ * what was consumed, so processing a stream is linear time.
+ * The unconsumed data is from data() to buffer+len. */
+class rbuf : public sbuf {
+public:
+    size_t pos = 0; // start of unconsumed data
+    char *data() { return buffer + pos; }
+    size_t data_length() { return len - pos; }
+    void consume(size_t count);
+    // Make room for at least needed more bytes at avail_start().
+    void reserve(int needed);
+    void reset() { sbuf::reset(); pos = 0; }
 };
 
 extern const char *extract_command_from_list(const char *, const char **,
@@ -0,0 +1,154 @@
+/* Scaling benchmark for id_table and name_index (lws-term/id-table.h).
+ *
+ * Enters N sessions and N windows (default 10000), then times
+ * entering them, looking a session up by number and by name, and
+ * the window-name uniqueness check, against the linear scans that
+ * id_table::enter, find_session and tty_client::set_window_name
+ * used to do.  Usage: bench-id-table [N]
+ */
+
+#include "id-table.h"
+#include <stdio.h>
+#include <time.h>
+
+struct session {
+    int number;
+    std::string name;
+    int index() { return number; }
+};
+
+struct window {
+    int number;
+    std::string name;
+    int index() { return number; }
+};
+
+static id_table<session> sessions;
+static id_table<window> windows;
+static name_index<session> sessions_by_name;
+static name_index<window> windows_by_name;
+
+bool
+id_tables_valid_index(int i)
+{
+    return sessions.valid_index(i) || windows.valid_index(i);
+}
+
+uint64_t
+id_tables_used_word(size_t w)
+{
+    return sessions.used_word(w) | windows.used_word(w);
+}
+
+/* The old id_table::enter: walk the tables from 1 for a free slot.
+ * Only the search is reproduced; the slot is then entered as usual. */
+static int
+linear_free_index()
+{
+    for (int snum = 1; ; snum++) {
+        if (! sessions.valid_index(snum) && ! windows.valid_index(snum))
+            return snum;
+    }
+}
+
+static double
+now_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+static void
+report(const char *what, long count, double indexed, double linear)
+{
+    printf("%-28s %8ld  indexed %9.3f ms  linear %9.3f ms  (%.0fx)\n",
+           what, count, 1e3 * indexed, 1e3 * linear,
+           indexed > 0 ? linear / indexed : 0.0);
+}
+
+int
+main(int argc, char **argv)
+{
+    long n = argc > 1 ? atol(argv[1]) : 10000;
+    std::vector<session> sbuf(n);
+    std::vector<window> wbuf(n);
+    volatile long sink = 0;
+
+    // enter, interleaving sessions and windows as the server does.
+    double t0 = now_sec();
+    for (long i = 0; i < n; i++) {
+        sbuf[i].number = -1;
+        sbuf[i].number = sessions.enter(&sbuf[i], -1);
+        wbuf[i].number = -1;
+        wbuf[i].number = windows.enter(&wbuf[i], -1);
+    }
+    double indexed = now_sec() - t0;
+    t0 = now_sec();
+    for (long i = 0; i < n; i++) {
+        sink += linear_free_index();
+        sink += linear_free_index();
+    }
+    double linear = now_sec() - t0;
+    // The linear searches above are against the full tables, so
+    // scale by 1/2 for the average cost while the tables fill.
+    report("enter (session+window)", 2 * n, indexed, linear / 2);
+
+    for (long i = 0; i < n; i++) {
+        sbuf[i].name = "session-" + std::to_string(i);
+        sessions_by_name.enter(sbuf[i].name, &sbuf[i]);
+        wbuf[i].name = "window-" + std::to_string(i);
+        windows_by_name.enter(wbuf[i].name, &wbuf[i]);
+    }
+
+    // find_session by number.  The old find_session walked all
+    // sessions, since a specifier matching more than one is ambiguous.
+    t0 = now_sec();
+    for (long i = 0; i < n; i++)
+        sink += sessions(sbuf[i].number) != nullptr;
+    indexed = now_sec() - t0;
+    t0 = now_sec();
+    for (long i = 0; i < n; i++) {
+        for (session *s = sessions.first(); s; s = sessions.next(s)) {
+            if (s->number == sbuf[i].number)
+                sink++;
+        }
+    }
+    linear = now_sec() - t0;
+    report("find_session (number)", n, indexed, linear);
+
+    // find_session by name.
+    t0 = now_sec();
+    for (long i = 0; i < n; i++) {
+        auto range = sessions_by_name.find(sbuf[i].name);
+        sink += range.first != range.second;
+    }
+    indexed = now_sec() - t0;
+    t0 = now_sec();
+    for (long i = 0; i < n; i++) {
+        for (session *s = sessions.first(); s; s = sessions.next(s)) {
+            if (s->name == sbuf[i].name)
+                sink++;
+        }
+    }
+    linear = now_sec() - t0;
+    report("find_session (name)", n, indexed, linear);
+
+    // Window-name uniqueness check (as in set_window_name).
+    t0 = now_sec();
+    for (long i = 0; i < n; i++)
+        sink += windows_by_name.count(wbuf[i].name) == 1;
+    indexed = now_sec() - t0;
+    t0 = now_sec();
+    for (long i = 0; i < n; i++) {
+        bool unique = true;
+        for (window *w = windows.first(); w; w = windows.next(w)) {
+            if (w != &wbuf[i] && w->name == wbuf[i].name)
+                unique = false;
+        }
+        sink += unique;
+    }
+    linear = now_sec() - t0;
+    report("window name uniqueness", n, indexed, linear);
+    return sink == 0;
+}
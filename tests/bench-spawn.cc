@@ -0,0 +1,69 @@
+/* Benchmark: how long it takes to start a command from a process with
+ * a large heap, using vfork+exec (as run_command does) and fork+exec.
+ * fork has to copy the page tables of the whole heap; vfork doesn't.
+ *
+ * Usage: bench-spawn [HEAP-MB [COUNT]]   (defaults: 1024 and 200)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+static double
+now_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+// Start /bin/true and wait for it; return seconds taken.
+static double
+spawn(bool use_vfork)
+{
+    static const char *argv[] = { "/bin/true", NULL };
+    double t0 = now_sec();
+    pid_t pid = use_vfork ? vfork() : fork();
+    if (pid == 0) {
+        execve(argv[0], (char**) argv, environ);
+        _exit(127);
+    }
+    if (pid < 0) {
+        perror(use_vfork ? "vfork" : "fork");
+        exit(EXIT_FAILURE);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    return now_sec() - t0;
+}
+
+int
+main(int argc, char **argv)
+{
+    long heap_mb = argc > 1 ? atol(argv[1]) : 1024;
+    int count = argc > 2 ? atoi(argv[2]) : 200;
+    // Touch every page, as preserved output in the server would.
+    size_t heap_size = (size_t) heap_mb << 20;
+    char *heap = (char *) malloc(heap_size);
+    if (heap == NULL) {
+        fprintf(stderr, "bench-spawn: cannot allocate %ld MB\n", heap_mb);
+        return EXIT_FAILURE;
+    }
+    memset(heap, 1, heap_size);
+
+    double total_fork = 0, total_vfork = 0;
+    for (int i = 0; i < count; i++) {
+        // Alternate, so both see the same system state.
+        total_fork += spawn(false);
+        total_vfork += spawn(true);
+    }
+    printf("heap %ld MB, %d spawns of /bin/true:\n", heap_mb, count);
+    printf("  fork+exec  %8.3f ms per spawn\n", 1e3 * total_fork / count);
+    printf("  vfork+exec %8.3f ms per spawn\n", 1e3 * total_vfork / count);
+    return heap[heap_size - 1] == 1 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,19 @@
+# Throughput benchmark: time 'cat' of a large file through a session
+# with a window, until the front-end has seen the end of it.
+# To compare two builds, run it with BIN_DOMTERM set to each.
+# Usage: sh bench-throughput.sh [LINES]   (default 2000000, about 15MB)
+. ./test-defs.sh
+set -e
+LINES=${1:-2000000}
+seq 1 $LINES >bench-throughput.txt
+BYTES=$(wc -c <bench-throughput.txt)
+${TNEWDOMTERM}
+${TDOMTERM} -w 1 await --match-output '1[$]' ''
+START=$(date +%s.%N)
+${TSEND_INPUT} 'cat bench-throughput.txt; echo done-$((6*7))\r'
+${TDOMTERM} -w 1 await --timeout 600 'timed out' --match-output 'done-42' ''
+END=$(date +%s.%N)
+${SEND_INPUT} -w 1 -C 'exit\r'
+rm -f bench-throughput.txt
+echo "$BYTES $START $END" | awk '{ t = $3 - $2;
+  printf "bench-throughput: %d bytes in %.2f s: %.1f MB/s\n", $1, t, $1 / t / 1e6 }'
@@ -0,0 +1,14 @@
+# Test 'await -s' (server-side output matching) on a session
+# that has no windows.
+. ./test-defs.sh
+set -e
+${TDOMTERM} --detached --name=await-detached ${TEST_SHELL}
+${TDOMTERM} await -s await-detached --timeout 10 'timed out' \
+  --match-output 'result-42' 'matched' >test-await-detached.out &
+AWAIT_PID=$!
+sleep 1
+${SEND_INPUT} -s await-detached 'echo result-$((6*7))\r'
+wait $AWAIT_PID
+test "$(cat test-await-detached.out)" = "matched"
+${SEND_INPUT} -s await-detached 'exit\r'
+echo test-await-detached OK
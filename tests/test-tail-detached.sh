@@ -0,0 +1,14 @@
+# Test 'tail -f' (raw output tap) on a session that has no windows.
+. ./test-defs.sh
+set -e
+${TDOMTERM} --detached --name=tail-detached ${TEST_SHELL}
+${TDOMTERM} tail -f -s tail-detached >test-tail-detached.out &
+TAIL_PID=$!
+sleep 1
+${SEND_INPUT} -s tail-detached 'echo result-$((6*7))\r'
+sleep 1
+# The tap finishes when the session exits.
+${SEND_INPUT} -s tail-detached 'exit\r'
+wait $TAIL_PID
+grep -q 'result-42' test-tail-detached.out
+echo test-tail-detached OK